@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "memory.h"
+#include "perf_counters.h"
+#include "regions.h"
+#include "tasks.h"
+#include "terrain.h"
+#include "timer.h"
+
+using namespace std;
+
+// timings of one generation stage at one map size
+class Stage {
+public:
+    const char* name;
+    int size;
+    vector<double> ms;
+    size_t bytes;
+    uint64_t counts[PerfCounters::COUNTERS];
+};
+
+// the region codec on one map
+class Codec {
+public:
+    int size;
+    bool deflate;
+    size_t bytes;
+    double encode_ms, decode_ms;
+    float error;
+};
+
+PerfCounters perf;
+
+// times one run of a stage and adds up its counters
+template<class F> void run(Stage& s, F f) {
+    uint64_t before[PerfCounters::COUNTERS], after[PerfCounters::COUNTERS];
+    perf.read(before);
+    auto t = now_ms();
+    f();
+    s.ms.push_back(now_ms()-t);
+    perf.read(after);
+    for (int c = 0; c < PerfCounters::COUNTERS; c++)
+        s.counts[c] += after[c]-before[c];
+}
+
+double percentile(vector<double> v, double p) {
+    sort(v.begin(), v.end());
+    return v[size_t(p*(v.size()-1)+0.5)];
+}
+
+vector<int> parse_list(const char* arg) {
+    vector<int> list;
+    for (auto p = arg; *p; p++) {
+        list.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (!p) break;
+    }
+    return list;
+}
+
+size_t mesh(const Map& map, bool instanced) {
+    auto n = (map.size+ChunkMesh::SIZE-1)/ChunkMesh::SIZE;
+    atomic<size_t> bytes(0);
+    TaskPool::shared().parallel_for(0, n*n, [&](size_t lo, size_t hi) {
+        ChunkMesh mesh;
+        size_t b = 0;
+        for (auto i = lo; i < hi; i++) {
+            mesh.build(map, int(i/n)*ChunkMesh::SIZE, int(i%n)*ChunkMesh::SIZE, instanced);
+            b += mesh.bytes();
+        }
+        bytes += b;
+    }, 1);
+    return bytes;
+}
+
+// one whole world, noise to block meshes
+void pipeline(int seed, int size, float frequency, float exponent) {
+    Map map {seed, size, frequency, exponent};
+    vector<uint8_t> types;
+    map.noise();
+    map.shape();
+    map.classify(types);
+    mesh(map, false);
+}
+
+int main(int argc, char** argv) {
+    vector<int> sizes {100, 250, 500, 1000, 2500},
+                threads;
+    auto cores = max(1, int(thread::hardware_concurrency()));
+    for (int t = 1; t < cores; t *= 2)
+        threads.push_back(t);
+    threads.push_back(cores);
+    auto seeds = 5,
+         runs = 3;
+    auto frequency = 1.f,
+         exponent = 1.f;
+    for (int i = 1; i+1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--sizes")) sizes = parse_list(argv[i+1]);
+        else if (!strcmp(argv[i], "--seeds")) seeds = atoi(argv[i+1]);
+        else if (!strcmp(argv[i], "--runs")) runs = atoi(argv[i+1]);
+        else if (!strcmp(argv[i], "--threads")) threads = parse_list(argv[i+1]);
+        else if (!strcmp(argv[i], "--frequency")) frequency = atof(argv[i+1]);
+        else if (!strcmp(argv[i], "--exponent")) exponent = atof(argv[i+1]);
+        else {
+            fprintf(stderr, "usage: %s [--sizes 100,500,...] [--seeds n] [--runs n] [--threads 1,2,...] [--frequency f] [--exponent e]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (seeds < 1 || runs < 1 || sizes.empty() || threads.empty()) {
+        fprintf(stderr, "need at least one size, seed, run and thread count\n");
+        return 1;
+    }
+
+    // stages run on this thread alone, so their counters cover all of their work
+    auto& pool = TaskPool::shared();
+    pool.resize(0);
+    perf.open();
+    vector<Stage> stages;
+    for (auto size : sizes) {
+        Stage noise {"noise", size}, shape {"shape", size}, classify {"classify", size},
+              blocks {"mesh_blocks", size}, columns {"mesh_columns", size};
+        for (int seed = 0; seed < seeds; seed++)
+            for (int i = 0; i < runs; i++) {
+                Map map {seed, size, frequency, exponent};
+                vector<uint8_t> types;
+
+                run(noise, [&] { map.noise(); });
+                noise.bytes = map.heights.size()*sizeof(float);
+
+                run(shape, [&] { map.shape(); });
+                shape.bytes = map.heights.size()*sizeof(float);
+
+                run(classify, [&] { map.classify(types); });
+                classify.bytes = types.size();
+
+                run(blocks, [&] { blocks.bytes = mesh(map, false); });
+                run(columns, [&] { columns.bytes = mesh(map, true); });
+            }
+        stages.insert(stages.end(), {noise, shape, classify, blocks, columns});
+    }
+
+    // the whole pipeline at the largest size, the caller being one of the threads
+    auto largest = *max_element(sizes.begin(), sizes.end());
+    vector<double> scaling;
+    for (auto t : threads) {
+        pool.resize(max(t, 1)-1);
+        vector<double> ms;
+        for (int seed = 0; seed < seeds; seed++)
+            for (int i = 0; i < runs; i++) {
+                auto start = now_ms();
+                pipeline(seed, largest, frequency, exponent);
+                ms.push_back(now_ms()-start);
+            }
+        scaling.push_back(percentile(ms, 0.5));
+    }
+
+    // the region codec on this thread alone, in megabytes of float heights per second
+    pool.resize(0);
+    vector<Codec> codecs;
+    for (auto size : sizes)
+        for (auto deflate : {false, true}) {
+            Codec c {size, deflate, 0, 0, 0, 0};
+            Map map {0, size, frequency, exponent};
+            map.noise();
+            map.shape();
+            vector<vector<uint8_t>> regions;
+            vector<double> encode, decode;
+            for (int i = 0; i < runs; i++) {
+                auto t = now_ms();
+                Regions::compress(map, deflate, regions);
+                encode.push_back(now_ms()-t);
+                Map back {0, size};
+                t = now_ms();
+                Regions::decompress(regions, deflate, back);
+                decode.push_back(now_ms()-t);
+                for (size_t j = 0; j < map.heights.size(); j++)
+                    c.error = max(c.error, abs(map.heights[j]-back.heights[j]));
+            }
+            for (auto& r : regions)
+                c.bytes += r.size();
+            c.encode_ms = percentile(encode, 0.5);
+            c.decode_ms = percentile(decode, 0.5);
+            codecs.push_back(c);
+        }
+
+    printf("{\n");
+    printf("  \"built\": \"%s %s\",\n", __DATE__, __TIME__);
+    printf("  \"seeds\": %d,\n  \"runs\": %d,\n", seeds, runs);
+    printf("  \"frequency\": %g,\n  \"exponent\": %g,\n", frequency, exponent);
+    auto process = Memory::process();
+    printf("  \"rss_bytes\": %zu,\n  \"peak_rss_bytes\": %zu,\n", process.rss, process.peak_rss);
+    printf("  \"perf_counters\": \"%s\",\n", PerfCounters::MODES[perf.mode]);
+    printf("  \"stages\": [\n");
+    for (size_t i = 0; i < stages.size(); i++) {
+        auto& s = stages[i];
+        auto median = percentile(s.ms, 0.5);
+        printf("    {\"stage\": \"%s\", \"size\": %d, \"samples\": %d, \"median_ms\": %.4f, \"p95_ms\": %.4f, "
+            "\"samples_per_s\": %.0f, \"bytes\": %zu",
+            s.name, s.size, int(s.ms.size()), median, percentile(s.ms, 0.95),
+            median > 0 ? double(s.size)*s.size/(median/1000) : 0, s.bytes);
+        // means per run
+        for (int c = 0; c < PerfCounters::COUNTERS; c++)
+            printf(", \"%s\": %.0f", perf.name(c), double(s.counts[c])/s.ms.size());
+        if (perf.mode == PerfCounters::Hardware && s.counts[PerfCounters::Cycles])
+            printf(", \"ipc\": %.3f", double(s.counts[PerfCounters::Instructions])/s.counts[PerfCounters::Cycles]);
+        printf("}%s\n", i+1 < stages.size() ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"scaling\": [\n");
+    for (size_t i = 0; i < threads.size(); i++)
+        printf("    {\"threads\": %d, \"size\": %d, \"median_ms\": %.4f, \"speedup\": %.3f, \"efficiency\": %.3f}%s\n",
+            threads[i], largest, scaling[i], scaling[0]/scaling[i], scaling[0]/scaling[i]*threads[0]/threads[i],
+            i+1 < threads.size() ? "," : "");
+    printf("  ],\n");
+    printf("  \"regions\": [\n");
+    for (size_t i = 0; i < codecs.size(); i++) {
+        auto& c = codecs[i];
+        auto mb = double(c.size)*c.size*sizeof(float)/1048576;
+        printf("    {\"size\": %d, \"deflate\": %s, \"bytes\": %zu, \"ratio\": %.2f, \"encode_mb_s\": %.1f, "
+            "\"decode_mb_s\": %.1f, \"max_error\": %g}%s\n",
+            c.size, c.deflate ? "true" : "false", c.bytes, mb*1048576/c.bytes, mb/(c.encode_ms/1000), mb/(c.decode_ms/1000),
+            c.error, i+1 < codecs.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
@@ -0,0 +1,68 @@
+#include "camera_path.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+using namespace glm;
+
+static const char MAGIC[4] = {'C', 'P', 'T', 'H'};
+
+void CameraPath::add(float time, vec3 position, float yaw, float pitch) {
+    samples.push_back({time, position, yaw, pitch});
+}
+
+bool CameraPath::save(const char* path) const {
+    auto f = fopen(path, "wb");
+    if (!f)
+        return false;
+    uint32_t header[] = {VERSION, uint32_t(samples.size())};
+    auto ok = fwrite(MAGIC, sizeof(MAGIC), 1, f) == 1 &&
+        fwrite(header, sizeof(header), 1, f) == 1 &&
+        fwrite(samples.data(), sizeof(Sample), samples.size(), f) == samples.size();
+    return fclose(f) == 0 && ok;
+}
+
+bool CameraPath::load(const char* path) {
+    auto f = fopen(path, "rb");
+    if (!f)
+        return false;
+    char magic[4];
+    uint32_t header[2];
+    auto ok = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, MAGIC, sizeof(MAGIC)) &&
+        fread(header, sizeof(header), 1, f) == 1 && header[0] == VERSION && header[1] > 0;
+    // the count is checked against what is left of the file before anything is allocated from it
+    if (ok) {
+        auto start = ftell(f);
+        ok = start >= 0 && fseek(f, 0, SEEK_END) == 0 && ftell(f)-start >= long(header[1]*sizeof(Sample)) &&
+            fseek(f, start, SEEK_SET) == 0;
+    }
+    if (ok) {
+        samples.resize(header[1]);
+        ok = fread(samples.data(), sizeof(Sample), samples.size(), f) == samples.size();
+    }
+    fclose(f);
+    if (!ok)
+        samples.clear();
+    return ok;
+}
+
+float CameraPath::duration() const {
+    return samples.empty() ? 0 : samples.back().time-samples.front().time;
+}
+
+CameraPath::Sample CameraPath::at(float time) const {
+    time += samples.front().time;
+    auto next = upper_bound(samples.begin(), samples.end(), time,
+        [](float t, const Sample& s) { return t < s.time; });
+    if (next == samples.begin()) return samples.front();
+    if (next == samples.end()) return samples.back();
+    auto& a = *(next-1);
+    auto& b = *next;
+    auto f = (time-a.time)/(b.time-a.time);
+    // yaw wraps around at a full turn
+    auto yaw = a.yaw + remainder(b.yaw-a.yaw, 2*3.14159265f)*f;
+    return {time, mix(a.position, b.position, f), yaw, mix(a.pitch, b.pitch, f)};
+}
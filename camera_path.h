@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// camera samples at increasing times, stored as a small header followed by packed samples
+class CameraPath {
+public:
+    class Sample {
+    public:
+        float time;
+        glm::vec3 position;
+        float yaw, pitch;
+    };
+    static const uint32_t VERSION = 1;
+
+    std::vector<Sample> samples;
+
+    void add(float time, glm::vec3 position, float yaw, float pitch);
+    bool save(const char* path) const;
+    bool load(const char* path);
+
+    float duration() const;
+    // at a time from the first sample, linear between samples and clamped to the ends
+    Sample at(float time) const;
+};
+
+static_assert(sizeof(CameraPath::Sample) == 24, "samples are written as they are laid out");
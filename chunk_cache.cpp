@@ -0,0 +1,52 @@
+#include "chunk_cache.h"
+
+#include <cmath>
+
+using namespace std;
+
+const vector<float>* HeightCache::find(ChunkKey key, int frame) {
+    auto e = entries.find(key);
+    if (e == entries.end()) {
+        stats.misses++;
+        return nullptr;
+    }
+    stats.hits++;
+    e->second.used = frame;
+    return &e->second.heights;
+}
+
+void HeightCache::insert(ChunkKey key, const vector<float>& heights, int frame) {
+    auto& e = entries[key];
+    stats.bytes += heights.size()*sizeof(float);
+    stats.bytes -= e.heights.size()*sizeof(float);
+    e.heights = heights;
+    e.used = frame;
+}
+
+void HeightCache::trim(ChunkKey center, int frame, const function<bool(ChunkKey)>& pinned) {
+    while (stats.bytes > stats.budget) {
+        auto worst = entries.end();
+        float worst_score = -1;
+        for (auto e = entries.begin(); e != entries.end(); ++e) {
+            if (pinned(e->first))
+                continue;
+            auto s = score(frame-e->second.used, hypot(float(e->first.first-center.first), float(e->first.second-center.second)));
+            if (s > worst_score) {
+                worst = e;
+                worst_score = s;
+            }
+        }
+        if (worst == entries.end())
+            return;
+        stats.bytes -= worst->second.heights.size()*sizeof(float);
+        stats.evictions++;
+        entries.erase(worst);
+    }
+}
+
+void HeightCache::clear() {
+    entries.clear();
+    auto budget = stats.budget;
+    stats = CacheStats();
+    stats.budget = budget;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+
+// a streamed chunk's index, its x and z divided by ChunkMesh::SIZE
+typedef std::pair<int, int> ChunkKey;
+
+// counts of one cache level, bytes in use against its budget
+class CacheStats {
+public:
+    size_t hits = 0, misses = 0, evictions = 0,
+           bytes = 0, budget = 0;
+
+    double hit_rate() const {
+        return hits+misses ? double(hits)/(hits+misses) : 0;
+    }
+};
+
+// compact heightmaps of streamed chunks, so chunks whose meshes were evicted come back without noise
+class HeightCache {
+public:
+    // a chunk farther away by one counts as this many frames less recently used
+    static const int FRAMES_PER_CHUNK = 30;
+    CacheStats stats;
+
+    // larger goes first
+    static float score(int age, float distance) {
+        return age + distance*FRAMES_PER_CHUNK;
+    }
+
+    // the heights of key or nullptr, counted as a hit or miss and marked used at frame
+    const std::vector<float>* find(ChunkKey key, int frame);
+    void insert(ChunkKey key, const std::vector<float>& heights, int frame);
+
+    // evicts the worst entries around center until the budget holds, never those pinned
+    void trim(ChunkKey center, int frame, const std::function<bool(ChunkKey)>& pinned);
+    void clear();
+
+private:
+    class Entry {
+    public:
+        std::vector<float> heights;
+        int used;
+    };
+    std::map<ChunkKey, Entry> entries;
+};
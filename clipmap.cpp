@@ -0,0 +1,94 @@
+#include "clipmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+using namespace glm;
+
+static const int MASK = Clipmap::SIDE-1;
+
+void Clipmap::reset(int n, int spacing) {
+    levels.resize(n);
+    for (auto& l : levels) {
+        l.spacing = spacing;
+        l.valid = false;
+        l.heights.assign(SIDE*SIDE, 0);
+        spacing *= 2;
+    }
+    updates.clear();
+}
+
+void Clipmap::update(float x, float z, const Map& world, TileFile* tiles) {
+    updates.clear();
+    for (size_t i = 0; i < levels.size(); i++) {
+        auto& l = levels[i];
+        // the corner stays on the next coarser level's grid, so the level's edge lies on that level's edges
+        auto nx = int(floor(x/(2*l.spacing)))*2 - HALF,
+             nz = int(floor(z/(2*l.spacing)))*2 - HALF;
+        auto dx = nx-l.x,
+             dz = nz-l.z;
+        if (!l.valid || abs(dx) >= GRID || abs(dz) >= GRID)
+            sample(l, i, nx, nz, GRID, GRID, world, tiles);
+        else {
+            // new columns over the new rows, then new rows over the new columns
+            if (dx)
+                sample(l, i, dx > 0 ? l.x+GRID : nx, nz, abs(dx), GRID, world, tiles);
+            if (dz)
+                sample(l, i, nx, dz > 0 ? l.z+GRID : nz, GRID, abs(dz), world, tiles);
+        }
+        l.x = nx;
+        l.z = nz;
+        l.valid = true;
+    }
+}
+
+vec4 Clipmap::bounds(int level) const {
+    auto& l = levels[level];
+    return vec4(l.x, l.z, l.x+GRID-1, l.z+GRID-1)*float(l.spacing);
+}
+
+void Clipmap::mesh(vector<int16_t>& xz, vector<uint32_t>& indices, size_t& ring) {
+    xz.clear();
+    indices.clear();
+    for (int i = 0; i < GRID; i++)
+        for (int j = 0; j < GRID; j++)
+            xz.insert(xz.end(), {int16_t(i), int16_t(j)});
+
+    // the finer level is off centre by up to one quad of this one, towards +x and +z
+    const int lo = HALF/2+1, hi = 3*HALF/2;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass)
+            ring = indices.size();
+        for (int i = 0; i+1 < GRID; i++)
+            for (int j = 0; j+1 < GRID; j++) {
+                if (pass && i >= lo && i < hi && j >= lo && j < hi)
+                    continue;
+                uint32_t a = i*GRID+j, b = a+GRID, c = b+1, d = a+1;
+                // counter clockwise seen from above, like the tops of blocks
+                indices.insert(indices.end(), {d, c, b, b, a, d});
+            }
+    }
+}
+
+// samples the w*h texels from texel (x, z) and records the pieces of the level's torus they land in
+void Clipmap::sample(Level& l, int level, int x, int z, int w, int h, const Map& world, TileFile* tiles) {
+    strip.resize(size_t(w)*h);
+    if (tiles)
+        tiles->sample(x*l.spacing, z*l.spacing, l.spacing, w, h, strip.data());
+    else
+        world.sample(x*l.spacing, z*l.spacing, l.spacing, w, h, strip.data());
+    for (int i = 0; i < w; i++)
+        for (int j = 0; j < h; j++)
+            l.heights[((z+j) & MASK)*SIDE + ((x+i) & MASK)] = strip[size_t(i)*h+j]+0.5f;
+
+    auto u = x & MASK,
+         v = z & MASK;
+    int us[] = {u, 0}, ws[] = {min(w, SIDE-u), w-min(w, SIDE-u)},
+        vs[] = {v, 0}, hs[] = {min(h, SIDE-v), h-min(h, SIDE-v)};
+    for (int a = 0; a < 2; a++)
+        for (int b = 0; b < 2; b++)
+            if (ws[a] && hs[b])
+                updates.push_back({level, us[a], vs[b], ws[a], hs[b]});
+}
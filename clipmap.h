@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "terrain.h"
+#include "tiles.h"
+
+// nested square grids of heights centred on the camera, each level twice the spacing of the one inside it,
+// for terrain out to the horizon at a fixed vertex count. Each level keeps SIDE*SIDE texels addressed by
+// world texel modulo SIDE, so when the camera moves only the rows and columns it uncovers are sampled.
+class Clipmap {
+public:
+    static const int SIDE = 128; // texels per level side, a power of two
+    static const int HALF = SIDE/2-2; // quads from a level's centre to its edge, even
+    static const int GRID = 2*HALF+1; // vertices per level side
+
+    class Level {
+    public:
+        int spacing; // blocks per texel
+        int x, z; // texel of the grid's first vertex, world block x*spacing
+        bool valid;
+        std::vector<float> heights; // block tops, texel (x, z) at (z & SIDE-1)*SIDE + (x & SIDE-1)
+    };
+
+    // texels of one level to upload since the last update, never wrapping
+    class Update {
+    public:
+        int level, u, v, w, h;
+    };
+
+    std::vector<Level> levels;
+    std::vector<Update> updates;
+
+    // levels of spacing, 2*spacing, ... blocks, all resampled on the next update
+    void reset(int levels, int spacing);
+    // moves every level to the camera at world block (x, z), sampling the uncovered texels from the tiles
+    // if there are any, otherwise from world's noise
+    void update(float x, float z, const Map& world, TileFile* tiles = nullptr);
+    // the world blocks a level covers, x0, z0, x1, z1
+    glm::vec4 bounds(int level) const;
+
+    // GRID*GRID vertices as x, z pairs and the indices of the whole grid, then from ring on those of the grid
+    // without its middle, which the next finer level covers
+    static void mesh(std::vector<int16_t>& xz, std::vector<uint32_t>& indices, size_t& ring);
+
+private:
+    std::vector<float> strip;
+
+    void sample(Level& l, int level, int x, int z, int w, int h, const Map& world, TileFile* tiles);
+};
@@ -0,0 +1,41 @@
+#include "counters.h"
+
+#include <algorithm>
+
+#include <imgui.h>
+
+using namespace std;
+
+const char* FrameCounters::NAMES[] = {
+    "draw_calls", "triangles", "vertices",
+    "chunks_visible", "chunks_frustum_culled", "chunks_occluded",
+    "uploaded_bytes", "state_changes", "shader_binds", "elided"
+};
+
+void FrameCounters::next_frame() {
+    auto& slot = history[frames%FRAMES];
+    frames++;
+    auto n = min(frames, size_t(FRAMES));
+    for (int c = 0; c < COUNTERS; c++) {
+        window[c] += now[c]-slot[c];
+        slot[c] = last[c] = now[c];
+        total[c] += now[c];
+        average[c] = double(window[c])/n;
+        now[c] = 0;
+    }
+}
+
+void FrameCounters::print_json(FILE* f) const {
+    fprintf(f, "{");
+    for (int c = 0; c < COUNTERS; c++)
+        fprintf(f, "%s\"%s\": %.2f", c ? ", " : "", NAMES[c], frames ? double(total[c])/frames : 0);
+    fprintf(f, "}");
+}
+
+void FrameCounters::draw_ui() const {
+    if (!ImGui::CollapsingHeader("counters"))
+        return;
+    ImGui::Text("last frame, average of %d", FRAMES);
+    for (int c = 0; c < COUNTERS; c++)
+        ImGui::Text("%s: %zu, %.1f", NAMES[c], last[c], average[c]);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+// what each frame submitted to GL, averaged over the last FRAMES frames and over the whole run
+class FrameCounters {
+public:
+    enum Counter {
+        DrawCalls, Triangles, Vertices,
+        ChunksVisible, ChunksFrustumCulled, ChunksOccluded,
+        UploadedBytes, StateChanges, ShaderBinds, Elided,
+        COUNTERS
+    };
+    static const char* NAMES[COUNTERS];
+    static const int FRAMES = 60;
+
+    size_t now[COUNTERS] = {}, // the frame being recorded
+           last[COUNTERS] = {},
+           total[COUNTERS] = {},
+           frames = 0;
+    double average[COUNTERS] = {};
+
+    size_t& operator[](Counter c) {
+        return now[c];
+    }
+
+    // closes the frame being recorded and starts the next at zero
+    void next_frame();
+
+    // per frame means over the whole run as a JSON object
+    void print_json(FILE* f) const;
+    void draw_ui() const;
+
+private:
+    size_t history[FRAMES][COUNTERS] = {},
+           window[COUNTERS] = {};
+};
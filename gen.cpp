@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "memory.h"
+#include "regions.h"
+#include "tasks.h"
+#include "terrain.h"
+#include "tiles.h"
+#include "trace.h"
+
+using namespace std;
+
+// blocks workers until the worlds they hold fit in a fixed number of bytes
+class Budget {
+public:
+    size_t limit, used = 0;
+
+    void acquire(size_t n) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return used+n <= limit; });
+        used += n;
+    }
+
+    void release(size_t n) {
+        {
+            lock_guard<mutex> lock(m);
+            used -= n;
+        }
+        cv.notify_all();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+};
+
+class Job {
+public:
+    int seed, size;
+    float frequency, exponent;
+};
+
+string out_dir = ".";
+auto write_mesh = false,
+     tiled = false,
+     regions = false,
+     deflate = false;
+Budget budget;
+mutex print_lock;
+atomic<int> failed(0);
+
+template<class T> vector<T> parse_list(const char* arg) {
+    vector<T> list;
+    for (auto p = arg; *p; p++) {
+        list.push_back(T(atof(p)));
+        p = strchr(p, ',');
+        if (!p) break;
+    }
+    return list;
+}
+
+// a range "first:last" or a list "a,b,c"
+vector<int> parse_seeds(const char* arg) {
+    auto colon = strchr(arg, ':');
+    if (!colon)
+        return parse_list<int>(arg);
+    vector<int> seeds;
+    for (int i = atoi(arg), last = atoi(colon+1); i <= last; i++)
+        seeds.push_back(i);
+    return seeds;
+}
+
+// heights, materials and one chunk of blocks, or a tile per thread of a tiled world.
+// Saved as regions, the packed regions are held as well until they are written, and while deflating
+// every thread holds one region before deflate
+size_t world_bytes(int size, int threads) {
+    if (tiled)
+        return Memory::map_bytes(TileFile::TILE)*(threads+1);
+    auto bytes = Memory::map_bytes(size) + size_t(size)*size*sizeof(uint8_t) + Memory::mesh_bytes(ChunkMesh::SIZE, false);
+    if (regions)
+        bytes += Regions::bound(size, deflate);
+    if (deflate)
+        bytes += Regions::bound(Regions::REGION, false)*(threads+1);
+    return bytes;
+}
+
+void report(const Job& job, bool ok, const string& base, double gen_ms, double write_ms, double total_ms, size_t bytes) {
+    lock_guard<mutex> lock(print_lock);
+    if (!ok) {
+        failed++;
+        fprintf(stderr, "writing %s failed\n", base.c_str());
+        return;
+    }
+    printf("{\"seed\": %d, \"size\": %d, \"frequency\": %g, \"exponent\": %g, \"gen_ms\": %.3f, \"write_ms\": %.3f, "
+        "\"total_ms\": %.3f, \"samples_per_s\": %.0f, \"bytes\": %zu}\n",
+        job.seed, job.size, job.frequency, job.exponent, gen_ms, write_ms,
+        total_ms, double(job.size)*job.size/(total_ms/1000), bytes);
+    fflush(stdout);
+}
+
+bool write_file(const string& path, const void* data, size_t n) {
+    auto f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    auto ok = fwrite(data, 1, n, f) == n;
+    return fclose(f) == 0 && ok;
+}
+
+// chunks back to back, each an int32 x, z, vertex and index count followed by the vertices and indices
+bool write_chunks(const string& path, const Map& map, size_t& bytes) {
+    auto f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    ChunkMesh mesh;
+    auto ok = true;
+    for (int cx = 0; ok && cx < map.size; cx += ChunkMesh::SIZE)
+        for (int cz = 0; ok && cz < map.size; cz += ChunkMesh::SIZE) {
+            mesh.build(map, cx, cz, false);
+            int32_t header[] = {mesh.x, mesh.z, int32_t(mesh.vertices.size()/3), int32_t(mesh.indices.size())};
+            ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                fwrite(mesh.vertices.data(), sizeof(float), mesh.vertices.size(), f) == mesh.vertices.size() &&
+                fwrite(mesh.indices.data(), sizeof(int), mesh.indices.size(), f) == mesh.indices.size();
+            bytes += sizeof(header) + mesh.bytes();
+        }
+    return fclose(f) == 0 && ok;
+}
+
+// tile i of a tiled world's file, counted over all levels: generated on level 0, coarser levels sampled
+// straight from the noise
+void make_tile(const Job& job, const TileFile& file, uint64_t i, int& level, int& tx, int& tz, vector<float>& heights) {
+    const auto t = file.tile;
+    level = 0;
+    for (; i >= uint64_t(file.tiles(level))*file.tiles(level); level++)
+        i -= uint64_t(file.tiles(level))*file.tiles(level);
+    auto n = file.tiles(level);
+    tx = int(i/n);
+    tz = int(i%n);
+    Map map {job.seed, t, job.frequency, job.exponent, tx*t, tz*t, float(job.size)};
+    if (level) {
+        map.heights.resize(size_t(t)*t);
+        map.sample(tx*t << level, tz*t << level, 1 << level, t, t, map.heights.data());
+    } else {
+        map.noise();
+        map.shape();
+    }
+    heights = move(map.heights);
+}
+
+// the world tile by tile into one .tiles file, a tile per thread in memory.
+// gen_ms and write_ms add up the time of all threads.
+bool generate_tiled(const Job& job, const string& path, double& gen_ms, double& write_ms, size_t& bytes) {
+    TileFile file;
+    if (!file.create(path.c_str(), {job.seed, job.size, job.frequency, job.exponent}, TileFile::TILE))
+        return false;
+    atomic<bool> ok(true);
+    atomic<uint64_t> gen_ns(0), write_ns(0);
+    TaskPool::shared().parallel_for(0, size_t(file.index(file.levels(), 0, 0)), [&](size_t lo, size_t hi) {
+        vector<float> heights;
+        for (auto i = lo; i < hi; i++) {
+            int level, tx, tz;
+            auto start = now_ns();
+            make_tile(job, file, i, level, tx, tz, heights);
+            auto generated = now_ns();
+            if (!file.write(tx, tz, heights, level))
+                ok = false;
+            gen_ns += generated-start;
+            write_ns += now_ns()-generated;
+        }
+    }, 1);
+    // summed over tiles, so time spent on all threads rather than wall time
+    gen_ms = gen_ns/1e6;
+    write_ms = write_ns/1e6;
+    bytes = file.bytes();
+    return file.close() && ok;
+}
+
+// one world between the tasks that make and write it
+class World {
+public:
+    string base;
+    Map map;
+    vector<uint8_t> types;
+    double start = 0, gen_ms = 0, write_start = 0;
+    atomic<bool> ok {true};
+    atomic<size_t> bytes {0};
+};
+
+// queues the tasks of one world holding held bytes of the budget, which the last of them gives back.
+// Its files are written in parallel once the map is made; the returned task is done when all are.
+TaskPool::Handle generate(const Job& job, size_t held) {
+    auto& pool = TaskPool::shared();
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%d_%d_%g_%g", out_dir.c_str(), job.seed, job.size, job.frequency, job.exponent);
+    string base = name;
+    if (tiled)
+        return pool.submit([&job, held, base] {
+            TRACE_ZONE("generate");
+            auto start = now_ms();
+            double gen_ms, write_ms;
+            size_t bytes;
+            auto ok = generate_tiled(job, base+".tiles", gen_ms, write_ms, bytes);
+            budget.release(held);
+            report(job, ok, base, gen_ms, write_ms, now_ms()-start, bytes);
+        });
+
+    auto w = make_shared<World>();
+    w->base = base;
+    auto made = pool.submit([&job, w] {
+        TRACE_ZONE("generate");
+        w->start = now_ms();
+        w->map = Map {job.seed, job.size, job.frequency, job.exponent};
+        {
+            TRACE_ZONE("noise");
+            w->map.noise();
+        }
+        {
+            TRACE_ZONE("shape");
+            w->map.shape();
+        }
+        w->gen_ms = now_ms()-w->start;
+        {
+            TRACE_ZONE("classify");
+            w->map.classify(w->types);
+        }
+        w->write_start = now_ms();
+    });
+
+    auto write = [&](function<bool(World&)> f) {
+        return pool.submit([w, f] {
+            TRACE_ZONE("write");
+            if (!f(*w))
+                w->ok = false;
+        }, TaskPool::Normal, {made});
+    };
+    vector<TaskPool::Handle> writes {
+        write([](World& w) {
+            size_t heights = w.map.heights.size()*sizeof(float);
+            auto ok = regions ? Regions::save((w.base+".regions").c_str(), w.map, deflate, heights) :
+                write_file(w.base+".heights", w.map.heights.data(), heights);
+            w.bytes += heights;
+            return ok;
+        }),
+        write([](World& w) {
+            w.bytes += w.types.size();
+            return write_file(w.base+".materials", w.types.data(), w.types.size());
+        })};
+    if (write_mesh)
+        writes.push_back(write([](World& w) {
+            size_t bytes = 0;
+            auto ok = write_chunks(w.base+".mesh", w.map, bytes);
+            w.bytes += bytes;
+            return ok;
+        }));
+
+    return pool.submit([&job, w, held] {
+        auto end = now_ms();
+        w->map = Map();
+        vector<uint8_t>().swap(w->types);
+        budget.release(held);
+        report(job, w->ok, w->base, w->gen_ms, end-w->write_start, end-w->start, w->bytes);
+    }, TaskPool::Normal, writes);
+}
+
+// FNV-1a, the same whatever the platform or thread count
+uint64_t fnv1a(const void* data, size_t n, uint64_t h = 14695981039346656037ull) {
+    auto p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i])*1099511628211ull;
+    return h;
+}
+
+class Hashes {
+public:
+    uint64_t heights, materials, mesh;
+
+    bool operator==(const Hashes& o) const {
+        return heights == o.heights && materials == o.materials && mesh == o.mesh;
+    }
+};
+
+// what a world would write, chunks hashed in parallel and combined in chunk order
+Hashes hash_world(const Job& job) {
+    Map map {job.seed, job.size, job.frequency, job.exponent};
+    map.noise();
+    map.shape();
+    vector<uint8_t> types;
+    map.classify(types);
+
+    auto n = (map.size+ChunkMesh::SIZE-1)/ChunkMesh::SIZE;
+    vector<uint64_t> chunks(n*n);
+    TaskPool::shared().parallel_for(0, chunks.size(), [&](size_t lo, size_t hi) {
+        ChunkMesh mesh;
+        for (auto i = lo; i < hi; i++) {
+            mesh.build(map, int(i/n)*ChunkMesh::SIZE, int(i%n)*ChunkMesh::SIZE, false);
+            int32_t header[] = {mesh.x, mesh.z, int32_t(mesh.vertices.size()/3), int32_t(mesh.indices.size())};
+            auto h = fnv1a(header, sizeof(header));
+            h = fnv1a(mesh.vertices.data(), mesh.vertices.size()*sizeof(float), h);
+            chunks[i] = fnv1a(mesh.indices.data(), mesh.indices.size()*sizeof(int), h);
+        }
+    }, 1);
+    return {fnv1a(map.heights.data(), map.heights.size()*sizeof(float)), fnv1a(types.data(), types.size()),
+        fnv1a(chunks.data(), chunks.size()*sizeof(uint64_t))};
+}
+
+// what a tiled world would write, every tile of every level hashed in parallel and combined in file order.
+// There are no materials or meshes
+Hashes hash_tiled(const Job& job) {
+    TileFile layout;
+    layout.size = job.size;
+    layout.tile = TileFile::TILE;
+    vector<uint64_t> tiles(size_t(layout.index(layout.levels(), 0, 0)));
+    TaskPool::shared().parallel_for(0, tiles.size(), [&](size_t lo, size_t hi) {
+        vector<float> heights;
+        for (auto i = lo; i < hi; i++) {
+            int level, tx, tz;
+            make_tile(job, layout, i, level, tx, tz, heights);
+            tiles[i] = fnv1a(heights.data(), heights.size()*sizeof(float));
+        }
+    }, 1);
+    return {fnv1a(tiles.data(), tiles.size()*sizeof(uint64_t)), 0, 0};
+}
+
+// generates every world on each thread count, counting the caller, and prints its hashes; 1 on any mismatch
+int verify(const vector<Job>& jobs, const vector<int>& counts) {
+    auto mismatched = 0;
+    for (auto& job : jobs) {
+        vector<Hashes> hashes;
+        for (auto t : counts) {
+            TaskPool::shared().resize(max(t, 1)-1);
+            hashes.push_back(tiled ? hash_tiled(job) : hash_world(job));
+        }
+        auto match = true;
+        for (auto& h : hashes)
+            match = match && h == hashes[0];
+        mismatched += !match;
+
+        printf("{\"seed\": %d, \"size\": %d, \"frequency\": %g, \"exponent\": %g, \"threads\": [",
+            job.seed, job.size, job.frequency, job.exponent);
+        for (size_t i = 0; i < counts.size(); i++)
+            printf("%s%d", i ? ", " : "", counts[i]);
+        auto print = [&](const char* name, uint64_t Hashes::*field) {
+            printf("], \"%s\": [", name);
+            for (size_t i = 0; i < hashes.size(); i++)
+                printf("%s\"%016llx\"", i ? ", " : "", (unsigned long long)(hashes[i].*field));
+        };
+        print("heights", &Hashes::heights);
+        print("materials", &Hashes::materials);
+        print("mesh", &Hashes::mesh);
+        printf("], \"match\": %s}\n", match ? "true" : "false");
+        fflush(stdout);
+    }
+    fprintf(stderr, "%d worlds on %d thread counts, %d mismatched\n", int(jobs.size()), int(counts.size()), mismatched);
+    return mismatched ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    vector<int> seeds {0},
+                sizes {100};
+    vector<float> frequencies {1},
+                  exponents {1};
+    vector<int> verify_threads;
+    auto threads = int(thread::hardware_concurrency());
+    size_t budget_mb = 1024;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        auto next = i+1 < argc ? argv[i+1] : nullptr;
+        if (!strcmp(arg, "--mesh")) write_mesh = true;
+        else if (!strcmp(arg, "--tiled")) tiled = true;
+        else if (!strcmp(arg, "--regions")) regions = true;
+        else if (!strcmp(arg, "--deflate")) regions = deflate = true;
+        else if (!next) arg = "";
+        else if (!strcmp(arg, "--seeds")) seeds = parse_seeds(argv[++i]);
+        else if (!strcmp(arg, "--sizes")) sizes = parse_list<int>(argv[++i]);
+        else if (!strcmp(arg, "--frequency")) frequencies = parse_list<float>(argv[++i]);
+        else if (!strcmp(arg, "--exponent")) exponents = parse_list<float>(argv[++i]);
+        else if (!strcmp(arg, "--threads")) threads = atoi(argv[++i]);
+        else if (!strcmp(arg, "--budget-mb")) budget_mb = atoi(argv[++i]);
+        else if (!strcmp(arg, "--out")) out_dir = argv[++i];
+        else if (!strcmp(arg, "--verify")) verify_threads = parse_list<int>(argv[++i]);
+        else arg = "";
+        if (!*arg) {
+            fprintf(stderr, "usage: %s [--seeds first:last|a,b,...] [--sizes a,b,...] [--frequency a,b,...] "
+                "[--exponent a,b,...] [--threads n] [--budget-mb n] [--out dir] [--mesh] [--regions [--deflate]] [--tiled] [--verify 1,2,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    threads = max(threads, 1);
+    budget.limit = budget_mb << 20;
+
+    vector<Job> jobs;
+    for (auto size : sizes) {
+        // tiled worlds are never whole in memory
+        auto largest = tiled ? TileFile::LARGEST : Regions::LARGEST;
+        if (size < 2 || size > largest || world_bytes(size, threads) > budget.limit) {
+            fprintf(stderr, "size %d does not fit in 2..%d and a %zu MB budget\n", size, largest, budget_mb);
+            return 1;
+        }
+        for (auto seed : seeds)
+            for (auto frequency : frequencies)
+                for (auto exponent : exponents)
+                    jobs.push_back({seed, size, frequency, exponent});
+    }
+    if (!verify_threads.empty())
+        return verify(jobs, verify_threads);
+    mkdir(out_dir.c_str(), 0755);
+
+    auto start = now_ms();
+    auto& pool = TaskPool::shared();
+    pool.resize(threads);
+    // worlds are only queued once their bytes are taken, so no worker ever blocks on the budget
+    vector<TaskPool::Handle> tasks;
+    for (auto& job : jobs) {
+        auto held = world_bytes(job.size, threads);
+        {
+            TRACE_ZONE("budget");
+            budget.acquire(held);
+        }
+        tasks.push_back(generate(job, held));
+    }
+    for (auto& t : tasks)
+        pool.wait(t);
+#ifdef COMANCHE_TRACE
+    Trace::write((out_dir+"/trace.json").c_str());
+#endif
+
+    fprintf(stderr, "%d worlds on %d threads in %.1f s, %d failed\n",
+        int(jobs.size()), threads, (now_ms()-start)/1000, int(failed));
+    return failed ? 1 : 0;
+}
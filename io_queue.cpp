@@ -0,0 +1,364 @@
+#include "io_queue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "timer.h"
+
+using namespace std;
+
+const char* IoQueue::NAMES[] = {"io_uring", "threads"};
+
+// no liburing, the three system calls are all it needs
+static int uring_setup(unsigned entries, io_uring_params* p) {
+    return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uring_enter(int ring, unsigned submit, unsigned complete, unsigned flags) {
+    return int(syscall(__NR_io_uring_enter, ring, submit, complete, flags, nullptr, 0));
+}
+
+static int uring_register(int ring, unsigned opcode, void* arg, unsigned n) {
+    return int(syscall(__NR_io_uring_register, ring, opcode, arg, n));
+}
+
+// errors after which io_uring_enter may succeed if called again
+static bool transient(int error) {
+    return error == EINTR || error == EAGAIN || error == EBUSY || error == ENOMEM;
+}
+
+IoQueue& IoQueue::shared() {
+    static IoQueue queue;
+    static once_flag started;
+    call_once(started, [] { queue.open(Uring, 64); });
+    return queue;
+}
+
+IoQueue::~IoQueue() {
+    close();
+}
+
+void IoQueue::open(Backend backend, unsigned n) {
+    close();
+    quit = false;
+    latencies.clear();
+    latency_next = 0;
+    if (backend == Uring && setup(n)) {
+        kind = Uring;
+        threads.emplace_back(&IoQueue::reap, this);
+    } else {
+        kind = Threads;
+        depth = n;
+        for (int i = 0; i < THREADS; i++)
+            threads.emplace_back(&IoQueue::serve, this);
+    }
+}
+
+bool IoQueue::setup(unsigned n) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring = uring_setup(n, &p);
+    if (ring < 0)
+        return false;
+    sq_bytes = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cq_bytes = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+    sqe_bytes = p.sq_entries*sizeof(io_uring_sqe);
+    auto single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_bytes = cq_bytes = max(sq_bytes, cq_bytes);
+    auto map = [&](size_t bytes, uint64_t offset) -> void* {
+        auto m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, off_t(offset));
+        return m == MAP_FAILED ? nullptr : m;
+    };
+    sq_ring = map(sq_bytes, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring : map(cq_bytes, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe*)map(sqe_bytes, IORING_OFF_SQES);
+    if (!sq_ring || !cq_ring || !sqes) {
+        release();
+        return false;
+    }
+    auto sq = (char*)sq_ring, cq = (char*)cq_ring;
+    sq_head = (unsigned*)(sq+p.sq_off.head);
+    sq_tail = (unsigned*)(sq+p.sq_off.tail);
+    sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq+p.sq_off.array);
+    cq_head = (unsigned*)(cq+p.cq_off.head);
+    cq_tail = (unsigned*)(cq+p.cq_off.tail);
+    cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq+p.cq_off.cqes);
+    // at most a submission ring of requests in flight, the completion ring is larger and never overflows
+    depth = p.sq_entries;
+
+    // kernels before 5.6 set up rings without the plain read, write and fadvise operations
+    const int OPS = 256;
+    vector<char> buffer(sizeof(io_uring_probe) + OPS*sizeof(io_uring_probe_op));
+    auto probe = (io_uring_probe*)buffer.data();
+    auto ok = uring_register(ring, IORING_REGISTER_PROBE, probe, OPS) == 0;
+    for (int op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FADVISE})
+        ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    if (!ok)
+        release();
+    return ok;
+}
+
+void IoQueue::release() {
+    if (sqes)
+        munmap(sqes, sqe_bytes);
+    if (cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_bytes);
+    if (sq_ring)
+        munmap(sq_ring, sq_bytes);
+    sqes = nullptr;
+    sq_ring = cq_ring = nullptr;
+    if (ring >= 0)
+        ::close(ring);
+    ring = -1;
+}
+
+void IoQueue::close() {
+    {
+        unique_lock<mutex> hold(lock);
+        idle.wait(hold, [&] { return pending.empty() && !in_flight; });
+        quit = true;
+        // a request without an op wakes the reaper to leave
+        if (kind == Uring && ring >= 0) {
+            auto tail = *sq_tail, index = tail & *sq_mask;
+            memset(&sqes[index], 0, sizeof(io_uring_sqe));
+            sqes[index].opcode = IORING_OP_NOP;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+            // nothing is in flight, so a ring short of resources soon has them again
+            while (uring_enter(ring, 1, 0, 0) < 0 && transient(errno))
+                if (errno != EINTR)
+                    this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    wake.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    release();
+    kind = Threads;
+}
+
+void IoQueue::submit(vector<Request>& batch) {
+    if (batch.empty())
+        return;
+    auto t = now_ns();
+    bool threaded;
+    vector<Op*> failed;
+    long error = 0;
+    {
+        lock_guard<mutex> hold(lock);
+        for (auto& r : batch)
+            pending.push_back(new Op {move(r), 0, t});
+        max_depth = max(max_depth, pending.size()+in_flight);
+        threaded = kind == Threads;
+        if (!threaded)
+            error = flush(failed);
+    }
+    batch.clear();
+    if (threaded)
+        wake.notify_all();
+    for (auto op : failed)
+        complete(op, error);
+}
+
+bool IoQueue::run(vector<Request>& batch) {
+    mutex m;
+    condition_variable finished;
+    auto left = batch.size();
+    auto ok = true;
+    for (auto& r : batch) {
+        auto done = move(r.done);
+        r.done = [&, done](bool good) {
+            if (done)
+                done(good);
+            // notified under the lock, so the waiter cannot return while this still uses it
+            lock_guard<mutex> hold(m);
+            ok = ok && good;
+            if (--left == 0)
+                finished.notify_all();
+        };
+    }
+    submit(batch);
+    unique_lock<mutex> hold(m);
+    finished.wait(hold, [&] { return left == 0; });
+    return ok;
+}
+
+IoQueue::Stats IoQueue::stats() {
+    lock_guard<mutex> hold(lock);
+    Stats s {kind, requests, bytes, pending.size()+in_flight, max_depth, 0, 0};
+    if (!latencies.empty()) {
+        auto l = latencies;
+        auto p50 = l.begin()+l.size()/2,
+             p99 = l.begin()+min(l.size()-1, l.size()*99/100);
+        nth_element(l.begin(), p50, l.end());
+        s.p50_us = *p50;
+        nth_element(l.begin(), p99, l.end());
+        s.p99_us = *p99;
+    }
+    return s;
+}
+
+// moves pending requests into free submission slots and submits them with one call, under the lock
+long IoQueue::flush(vector<Op*>& failed) {
+    auto tail = *sq_tail;
+    auto moved = false;
+    while (!pending.empty() && in_flight < depth) {
+        auto op = pending.front();
+        pending.pop_front();
+        auto& r = op->request;
+        auto index = tail++ & *sq_mask;
+        auto& s = sqes[index];
+        memset(&s, 0, sizeof(s));
+        s.fd = r.fd;
+        s.off = r.offset+op->moved;
+        s.user_data = uint64_t(uintptr_t(op));
+        if (r.op == Request::Advise) {
+            s.opcode = IORING_OP_FADVISE;
+            s.len = uint32_t(min(r.bytes, size_t(1) << 30));
+            s.fadvise_advice = POSIX_FADV_WILLNEED;
+        } else {
+            s.opcode = r.op == Request::Read ? IORING_OP_READ : IORING_OP_WRITE;
+            s.addr = uint64_t(uintptr_t((char*)r.data+op->moved));
+            s.len = uint32_t(min(r.bytes-op->moved, size_t(1) << 30));
+        }
+        sq_array[index] = index;
+        in_flight++;
+        moved = true;
+    }
+    if (!moved)
+        return 0;
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    // everything the kernel has not consumed, including entries a partial submission left behind
+    auto unsubmitted = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    int got;
+    while ((got = uring_enter(ring, unsubmitted, 0, 0)) < 0 && errno == EINTR)
+        ;
+    if (got >= 0)
+        return 0;
+    long error = -errno;
+
+    // a call that fails consumes nothing, so the entries are taken back out of the ring. With requests still
+    // in flight their completions retry them, otherwise nothing would and they fail with the error
+    auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    vector<Op*> back;
+    for (auto i = head; i != tail; i++)
+        back.push_back((Op*)uintptr_t(sqes[i & *sq_mask].user_data));
+    __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    if (in_flight > back.size()) {
+        in_flight -= back.size();
+        pending.insert(pending.begin(), back.begin(), back.end());
+        return 0;
+    }
+    failed.insert(failed.end(), back.begin(), back.end());
+    return error;
+}
+
+// the ring's completion thread
+void IoQueue::reap() {
+    vector<pair<Op*, long>> got;
+    for (;;) {
+        uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS);
+        got.clear();
+        auto leave = false;
+        auto head = *cq_head,
+             tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            auto& c = cqes[head & *cq_mask];
+            if (c.user_data)
+                got.push_back(make_pair((Op*)uintptr_t(c.user_data), long(c.res)));
+            else
+                leave = true;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        for (auto& g : got)
+            complete(g.first, g.second);
+        if (leave)
+            return;
+    }
+}
+
+// a fallback thread, blocking on one request at a time
+void IoQueue::serve() {
+    for (;;) {
+        Op* op;
+        {
+            unique_lock<mutex> hold(lock);
+            wake.wait(hold, [&] { return quit || !pending.empty(); });
+            if (pending.empty())
+                return;
+            op = pending.front();
+            pending.pop_front();
+            in_flight++;
+        }
+        auto& r = op->request;
+        long result = 0;
+        if (r.op == Request::Advise)
+            result = -posix_fadvise(r.fd, off_t(r.offset), off_t(r.bytes), POSIX_FADV_WILLNEED);
+        else while (op->moved < r.bytes) {
+            auto p = (char*)r.data+op->moved;
+            auto n = r.bytes-op->moved;
+            auto offset = off_t(r.offset+op->moved);
+            auto got = r.op == Request::Read ? pread(r.fd, p, n, offset) : pwrite(r.fd, p, n, offset);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0) {
+                result = got < 0 ? -errno : 0;
+                break;
+            }
+            op->moved += size_t(got);
+        }
+        complete(op, result);
+    }
+}
+
+// result is bytes moved or a negative errno from the ring, 0 or an error from the fallback that moved them itself
+void IoQueue::complete(Op* op, long result) {
+    auto& r = op->request;
+    auto transfer = r.op != Request::Advise;
+    if (transfer && result > 0)
+        op->moved += size_t(result);
+    // a short read or write continues where it stopped, ahead of newer requests
+    auto more = transfer && result > 0 && op->moved < r.bytes;
+    auto ok = result >= 0 && (!transfer || op->moved == r.bytes);
+    vector<Op*> failed;
+    long error = 0;
+    {
+        lock_guard<mutex> hold(lock);
+        in_flight--;
+        if (more)
+            pending.push_front(op);
+        else {
+            requests++;
+            bytes += op->moved;
+            auto us = (now_ns()-op->start_ns)/1e3f;
+            if (latencies.size() < size_t(LATENCIES))
+                latencies.push_back(us);
+            else
+                latencies[latency_next] = us;
+            latency_next = (latency_next+1)%LATENCIES;
+        }
+        if (kind == Uring)
+            error = flush(failed);
+        if (pending.empty() && !in_flight)
+            idle.notify_all();
+    }
+    for (auto f : failed)
+        complete(f, error);
+    if (more)
+        return;
+    if (r.done)
+        r.done(ok);
+    delete op;
+}
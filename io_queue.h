@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// asynchronous file reads, writes and readahead hints, so neither the render thread nor the workers wait on
+// disk. Requests go to io_uring where the kernel has it, a batch with one system call, and to blocking calls
+// on THREADS threads otherwise. Completions run on an I/O thread, so they should only hand work on.
+class IoQueue {
+public:
+    enum Backend {Uring, Threads, BACKENDS};
+    static const char* NAMES[BACKENDS];
+    static const int THREADS = 4; // of the fallback, enough to keep a disk busy
+    static const int LATENCIES = 1024; // most recent completions the percentiles are over
+
+    class Request {
+    public:
+        enum Op {Read, Write, Advise}; // Advise starts reading bytes into the page cache, data unused
+        Op op;
+        int fd;
+        void* data;
+        size_t bytes;
+        uint64_t offset;
+        std::function<void(bool ok)> done; // after every byte moved, or on the first error
+    };
+
+    class Stats {
+    public:
+        Backend backend;
+        size_t requests, bytes; // completed
+        size_t depth, max_depth; // submitted and not completed
+        float p50_us, p99_us; // from submitting to completing, over the last LATENCIES requests
+    };
+
+    // io_uring if the kernel allows it, started on first use
+    static IoQueue& shared();
+
+    ~IoQueue();
+    // waits for requests in flight and restarts with this backend and depth, threads if io_uring fails
+    void open(Backend backend, unsigned depth);
+    // waits for requests in flight and stops, requests submitted after wait until it is opened again
+    void close();
+    Backend backend() const {
+        return kind;
+    }
+
+    // queues the whole batch and clears it, requests beyond the depth wait for earlier ones to complete
+    void submit(std::vector<Request>& batch);
+    // submits a batch and waits for it, false if any request failed
+    bool run(std::vector<Request>& batch);
+    Stats stats();
+
+private:
+    class Op {
+    public:
+        Request request;
+        size_t moved;
+        uint64_t start_ns;
+    };
+
+    Backend kind = Threads;
+    unsigned depth = 0;
+    std::mutex lock;
+    std::condition_variable wake, idle;
+    std::deque<Op*> pending;
+    size_t in_flight = 0;
+    bool quit = false;
+    std::vector<std::thread> threads; // the reaper of the ring, or the fallback's threads
+
+    // the submission and completion rings shared with the kernel
+    int ring = -1;
+    void *sq_ring = nullptr, *cq_ring = nullptr;
+    size_t sq_bytes = 0, cq_bytes = 0, sqe_bytes = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr,
+             *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    size_t requests = 0, bytes = 0, max_depth = 0;
+    std::vector<float> latencies; // a ring of microseconds
+    size_t latency_next = 0;
+
+    bool setup(unsigned depth);
+    void release();
+    // ops the kernel refused while nothing else was in flight go to failed, with the error returned
+    long flush(std::vector<Op*>& failed);
+    void reap();
+    void serve();
+    void complete(Op* op, long result);
+};
@@ -1,64 +1,354 @@
-#include <array>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <map>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 #include <vector>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#ifdef COMANCHE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 #include <lodepng.h>
-#include <OpenSimplex/OpenSimplex.h>
+
+#include "camera_path.h"
+#include "chunk_cache.h"
+#include "clipmap.h"
+#include "counters.h"
+#include "memory.h"
+#include "io_queue.h"
+#include "occlusion.h"
+#include "profiler.h"
+#include "regions.h"
+#include "scheduler.h"
+#include "tasks.h"
+#include "terrain.h"
+#include "tiles.h"
+#include "timer.h"
+#include "trace.h"
 
 using namespace std;
 using namespace glm;
 
-class Block {
+// ChunkMesh::SIZE squared blocks sharing one VAO and one draw call
+class Chunk {
+public:
+    int x, z;
+    vec3 lo, hi;
+    float top; // lowest column top, everything below is solid
+    float distance;
+    GLuint vao, vbo, ibo;
+    GLsizei count;
+    size_t bytes;
+    int used; // stream frame it was last in range
+    bool wanted; // in range, or beyond it by less than the hysteresis since
+};
+
+// elides redundant binds and uniform uploads, counts what reaches GL
+class RenderState {
+public:
+    GLuint program = 0, vao = 0, texture = 0;
+    FrameCounters counters;
+
+    void use(GLuint id) {
+        if (count(program == id)) return;
+        counters[FrameCounters::ShaderBinds]++;
+        glUseProgram(program = id);
+    }
+
+    void bind(GLuint id) {
+        if (count(vao == id)) return;
+        glBindVertexArray(vao = id);
+    }
+
+    void bind_texture(GLuint id) {
+        if (count(texture == id)) return;
+        glBindTexture(GL_TEXTURE_2D, texture = id);
+    }
+
+    void uniform(GLint loc, const mat4& m) {
+        if (count(cached(loc, &m[0][0], sizeof(mat4)))) return;
+        glUniformMatrix4fv(loc, 1, false, &m[0][0]);
+    }
+
+    void uniform(GLint loc, const vec3& v) {
+        if (count(cached(loc, &v[0], sizeof(vec3)))) return;
+        glUniform3fv(loc, 1, &v[0]);
+    }
+
+    void uniform(GLint loc, const vec4& v) {
+        if (count(cached(loc, &v[0], sizeof(vec4)))) return;
+        glUniform4fv(loc, 1, &v[0]);
+    }
+
+    void uniform(GLint loc, const ivec2& v) {
+        if (count(cached(loc, &v[0], sizeof(ivec2)))) return;
+        glUniform2iv(loc, 1, &v[0]);
+    }
+
+    void uniform(GLint loc, GLint i) {
+        if (count(cached(loc, &i, sizeof(i)))) return;
+        glUniform1i(loc, i);
+    }
+
+    void uniform(GLint loc, GLfloat f) {
+        uniform(loc, &f, 1);
+    }
+
+    void uniform(GLint loc, const GLfloat* f, GLsizei n) {
+        if (count(cached(loc, f, n*sizeof(GLfloat)))) return;
+        glUniform1fv(loc, n, f);
+    }
+
+    void draw(GLsizei n, size_t first = 0) {
+        count_draw(n, 1);
+        glDrawElements(GL_TRIANGLES, n, GL_UNSIGNED_INT, (void*)(first*sizeof(GLuint)));
+    }
+
+    void draw_instanced(GLsizei n, GLsizei instances) {
+        count_draw(n, instances);
+        glDrawElementsInstanced(GL_TRIANGLES, n, GL_UNSIGNED_BYTE, nullptr, instances);
+    }
+
+private:
+    map<pair<GLuint, GLint>, vector<char>> uniforms;
+
+    bool count(bool redundant) {
+        counters[redundant ? FrameCounters::Elided : FrameCounters::StateChanges]++;
+        return redundant;
+    }
+
+    void count_draw(GLsizei n, GLsizei instances) {
+        counters[FrameCounters::DrawCalls]++;
+        counters[FrameCounters::Triangles] += size_t(n/3)*instances;
+        counters[FrameCounters::Vertices] += size_t(n)*instances;
+    }
+
+    bool cached(GLint loc, const void* data, size_t n) {
+        auto& v = uniforms[make_pair(program, loc)];
+        if (v.size() == n && !memcmp(&v[0], data, n))
+            return true;
+        v.assign((const char*)data, (const char*)data+n);
+        return false;
+    }
+};
+
+// bytes held by GL buffers per category, kept up to date at every glBufferData
+class GpuMemory {
 public:
-    enum Type {WaterDeep=1, WaterShallow, Grass, Forest, Stone, Snow};
-    static constexpr const char* VERTEX_SHADER = R"(
+    enum Category {Vertices, Indices, Columns, Cube, Clipmap, CATEGORIES};
+    size_t bytes[CATEGORIES] = {},
+           uploaded = 0; // since the last frame
+
+    void buffer_data(GLenum target, GLuint id, Category c, size_t n, const void* data) {
+        release(id);
+        glBufferData(target, n, data, GL_STATIC_DRAW);
+        buffers[id] = make_pair(c, n);
+        bytes[c] += n;
+        uploaded += n;
+    }
+
+    // call before glDeleteBuffers
+    void release(GLuint id) {
+        auto b = buffers.find(id);
+        if (b == buffers.end()) return;
+        bytes[b->second.first] -= b->second.second;
+        buffers.erase(b);
+    }
+
+    size_t total() const {
+        size_t n = 0;
+        for (auto b : bytes)
+            n += b;
+        return n;
+    }
+
+private:
+    map<GLuint, pair<Category, size_t>> buffers;
+};
+
+class Program {
+public:
+    GLuint id;
+    GLint mvp_u, texture_u, size_u, thresholds_u, origin_u,
+          heights_u, corner_u, level_u, spacing_u, edge_u, hole_u, extent_u;
+
+    // the last vertex of every triangle lies on top of the block that owns the face
+    static constexpr const char* BLOCK_SHADER = R"(
         #version 330 core
         uniform mat4 mvp;
+        uniform vec3 origin;
+        uniform float size;
+        uniform float thresholds[5];
         layout(location = 0) in vec3 xyz;
-        layout(location = 1) in vec2 uv_in;
-        out vec2 uv;
+        flat out vec2 uv;
         void main() {	
-            gl_Position = mvp*vec4(xyz, 1);
-            uv = uv_in;
+            gl_Position = mvp*vec4(xyz+origin, 1);
+            float y = (xyz.y-0.5)/size;
+            int type = 1;
+            for (int i = 0; i < 5; i++)
+                type += int(y >= thresholds[i]);
+            uv = vec2(type/6.0-0.1, 0);
+        })";
+    static constexpr const char* COLUMN_SHADER = R"(
+        #version 330 core
+        uniform mat4 mvp;
+        uniform vec3 origin;
+        uniform float size;
+        uniform float thresholds[5];
+        layout(location = 0) in vec3 xyz;
+        layout(location = 1) in uint xz;
+        layout(location = 2) in ivec2 heights;
+        flat out vec2 uv;
+        void main() {
+            float y = heights.x/8.0,
+                  low = min(heights.y/8.0, y);
+            vec3 pos = origin + vec3(float(xz & 0x3FFFu), mix(low, y, xyz.y)+0.5, float((xz >> 14) & 0x3FFFu));
+            gl_Position = mvp*vec4(pos+vec3(xyz.x, 0, xyz.z), 1);
+            int type = 1;
+            for (int i = 0; i < 5; i++)
+                type += int(y/size >= thresholds[i]);
+            uv = vec2(type/6.0-0.1, 0);
+        })";
+    // one clipmap level, grid vertices placed at the level's corner texel plus their grid position
+    static constexpr const char* CLIPMAP_SHADER = R"(
+        #version 330 core
+        uniform mat4 mvp;
+        uniform float size;
+        uniform float thresholds[5];
+        uniform sampler2DArray heights;
+        uniform ivec2 corner;
+        uniform int level, edge;
+        uniform float spacing;
+        layout(location = 0) in ivec2 grid;
+        flat out vec2 uv;
+        out vec2 world;
+        float height(ivec2 g) {
+            return texelFetch(heights, ivec3((corner+g) & (textureSize(heights, 0).xy-1), level), 0).r;
+        }
+        void main() {
+            float y = height(grid);
+            // odd vertices of the outer edge lie on the coarser level's edge, so the levels meet without cracks
+            if ((grid.x == 0 || grid.x == edge) && (grid.y & 1) == 1)
+                y = (height(grid-ivec2(0, 1))+height(grid+ivec2(0, 1)))/2;
+            if ((grid.y == 0 || grid.y == edge) && (grid.x & 1) == 1)
+                y = (height(grid-ivec2(1, 0))+height(grid+ivec2(1, 0)))/2;
+            world = vec2(corner+grid)*spacing;
+            gl_Position = mvp*vec4(world.x, y, world.y, 1);
+            int type = 1;
+            for (int i = 0; i < 5; i++)
+                type += int((y-0.5)/size >= thresholds[i]);
+            uv = vec2(type/6.0-0.1, 0);
+        })";
+    // the middle of a level is left to the next finer one, or to the chunks
+    static constexpr const char* CLIPMAP_FRAGMENT_SHADER = R"(
+        #version 330 core
+        uniform sampler2D texture;
+        uniform vec4 hole;
+        uniform float extent;
+        flat in vec2 uv;
+        in vec2 world;
+        out vec4 color;
+        void main() {
+            if (all(greaterThan(world, hole.xy)) && all(lessThan(world, hole.zw)))
+                discard;
+            // a tiled world ends at its edge, extent 0 goes on
+            if (extent > 0 && (any(lessThan(world, vec2(-0.5))) || any(greaterThan(world, vec2(extent-0.5)))))
+                discard;
+            color = texture2D(texture, uv);
         })";
     static constexpr const char* FRAGMENT_SHADER = R"(
         #version 330 core
         uniform sampler2D texture;
-        in vec2 uv;
+        flat in vec2 uv;
         out vec4 color;
         void main() {
             color = texture2D(texture, uv);
         })";
+    // additive, red counts fragments exactly, green and blue saturate early to make overdraw visible
+    static constexpr const char* OVERDRAW_SHADER = R"(
+        #version 330 core
+        out vec4 color;
+        void main() {
+            color = vec4(1.0/255, 1.0/8, 1.0/32, 1);
+        })";
 };
 
 GLFWwindow* win;
 int width, height;
+#ifdef COMANCHE_EGL
+EGLDisplay egl_display = EGL_NO_DISPLAY;
+EGLContext egl_context = EGL_NO_CONTEXT;
+#endif
+GLuint fbo, fbo_color, fbo_depth;
 
-GLuint vbo, ibo, uvo, block_gl;
-GLint mvp_u, texture_u;
+GLuint texture, cube_vbo, cube_ibo;
+Program block_gl, column_gl, block_overdraw_gl, column_overdraw_gl, clipmap_gl;
 
-vector<float> heightmap, vertices;
-vector<int> indices;
-vector<vec2> uvs;
+Map world;
+vector<ChunkMesh> batch; // meshed in parallel by gen_map, keeps its capacity between maps
+map<ChunkKey, Chunk> chunks; // addresses stay put while streaming
+vector<Chunk*> order, visible;
+RenderState state;
+GpuMemory gpu_memory;
+Occlusion occlusion;
+Profiler profiler;
 
 auto sky_color = ImVec4(0, 0, 0, 0);
 auto seed = 0,
      size = 100;
 auto frequency = 1.f,
      exponent = 1.f;
+auto thresholds = vector<float>(begin(Block::THRESHOLDS), end(Block::THRESHOLDS));
+
+auto cursor = true,
+     streaming = false,
+     instanced = false,
+     occlusion_culling = true,
+     front_to_back = true,
+     overdraw = false;
 
-auto cursor = true;
+auto gen_ms = 0.0,
+     cull_ms = 0.0;
+size_t mesh_bytes = 0,
+       io_bytes = 0; // read and written through the I/O queue when the counters were reset
+int occluders;
+auto fragments_per_pixel = 0.f;
+const size_t max_occluders = 32;
+auto stream_radius = 8, // in chunks
+     upload_budget_kb = 1024, // per frame
+     cpu_budget_mb = 64,
+     gpu_budget_mb = 256,
+     stream_frame = 0;
+const auto stream_hysteresis = 2;
+HeightCache heights_cache;
+CacheStats mesh_cache;
+ChunkScheduler scheduler;
+TileFile tiles; // an out-of-core world opened with --world, size 0 otherwise
+Map saved; // a world loaded from a .regions file, shown by gen_map until the world parameters change
+auto tile_budget_mb = 256;
 
+// far terrain around the streamed chunks, one texture layer per level
+Clipmap clipmap;
+GLuint clipmap_texture, clipmap_vao, clipmap_vbo, clipmap_ibo;
+GLsizei clipmap_count;
+size_t clipmap_ring;
+auto clipmap_on = false;
+auto clipmap_levels = 8,
+     clipmap_layers = 0; // allocated in clipmap_texture
+
+const auto block_size = 5.f;
 auto sensitivity = 0.0005f,
      speed = 100.f,
      fov = 60.f;
@@ -67,6 +357,11 @@ auto yaw = radians(45.0),
 vec3 direction,
      position(-size, size, -size);
 
+CameraPath camera_path;
+const char* record_path = nullptr;
+auto replaying = false;
+const auto replay_step = 1/60.f;
+
 void reseed() {
     seed = rand()%SHRT_MAX+SHRT_MIN;
 }
@@ -162,84 +457,294 @@ GLuint load_glsl(const char* vertex_src, const char* fragment_src) {
     return id;
 }
 
-void add_face(initializer_list<int> face, bool cond) {
-    if (cond) 
-        for (int i : face)
-            indices.push_back(i+(vertices.size()-36)/3);
-}
-
-void add_block(int x, int z) {
-    const auto a = 0.5f;
-    auto y = heightmap[x*size+z],
-         y0 = z == size-1 ? -1 : a-y+heightmap[x*size+z+1],
-         y1 = z == 0 ? -1 : a-y+heightmap[x*size+z-1],
-         y2 = x == size-1 ? -1 : a-y+heightmap[(x+1)*size+z],
-         y3 = x == 0 ? -1 : a-y+heightmap[(x-1)*size+z];
-    array<float, 36> verts {
-        -a, y0,  a,
-         a, y0,  a,
-         a,  a,  a,
-        -a,  a,  a,
-        -a, y1, -a,
-        -a,  a, -a,
-         a,  a, -a,
-         a, y1, -a,
-        -a, y3,  a, 
-         a, y2,  a,
-        -a, y3, -a,
-         a, y2, -a
+Program load_program(const char* vertex_src, const char* fragment_src) {
+    auto id = load_glsl(vertex_src, fragment_src);
+    return {
+        id,
+        glGetUniformLocation(id, "mvp"),
+        glGetUniformLocation(id, "texture"),
+        glGetUniformLocation(id, "size"),
+        glGetUniformLocation(id, "thresholds"),
+        glGetUniformLocation(id, "origin"),
+        glGetUniformLocation(id, "heights"),
+        glGetUniformLocation(id, "corner"),
+        glGetUniformLocation(id, "level"),
+        glGetUniformLocation(id, "spacing"),
+        glGetUniformLocation(id, "edge"),
+        glGetUniformLocation(id, "hole"),
+        glGetUniformLocation(id, "extent")
     };
-    for (int i = 0; i < verts.size();) {
-        vertices.insert(vertices.end(), {verts[i++]+x, verts[i++]+y, verts[i++]+z});
+}
 
-        auto y0 = y/size;
-        auto type = y0 < -0.5 ? Block::WaterDeep :
-            y0 < 0.0 ? Block::WaterShallow :
-            y0 < 0.3 ? Block::Grass :
-            y0 < 0.5 ? Block::Forest :
-            y0 < 0.7 ? Block::Stone :
-            Block::Snow;
-        uvs.push_back(vec2(type/6.f-0.1, 0));
-    }
+void upload_blocks(Chunk& c, const ChunkMesh& mesh) {
+    c.count = mesh.indices.size();
+    glGenVertexArrays(1, &c.vao);
+    state.bind(c.vao);
+    glGenBuffers(1, &c.vbo);
+    glGenBuffers(1, &c.ibo);
+
+    glBindBuffer(GL_ARRAY_BUFFER, c.vbo);
+    gpu_memory.buffer_data(GL_ARRAY_BUFFER, c.vbo, GpuMemory::Vertices, mesh.vertices.size()*sizeof(float), mesh.vertices.data());
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, nullptr);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c.ibo);
+    gpu_memory.buffer_data(GL_ELEMENT_ARRAY_BUFFER, c.ibo, GpuMemory::Indices, c.count*sizeof(int), mesh.indices.data());
+}
+
+void upload_columns(Chunk& c, const ChunkMesh& mesh) {
+    c.count = mesh.columns.size();
+    c.ibo = 0;
+    glGenVertexArrays(1, &c.vao);
+    state.bind(c.vao);
+    glGenBuffers(1, &c.vbo);
+
+    glBindBuffer(GL_ARRAY_BUFFER, cube_vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, nullptr);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_ibo);
+    glBindBuffer(GL_ARRAY_BUFFER, c.vbo);
+    gpu_memory.buffer_data(GL_ARRAY_BUFFER, c.vbo, GpuMemory::Columns, c.count*sizeof(Column), mesh.columns.data());
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(Column), (void*)offsetof(Column, xz));
+    glVertexAttribIPointer(2, 2, GL_SHORT, sizeof(Column), (void*)offsetof(Column, y));
+    glVertexAttribDivisor(1, 1);
+    glVertexAttribDivisor(2, 1);
+}
+
+ChunkKey chunk_key(int x, int z) {
+    return make_pair(int(floor(float(x)/ChunkMesh::SIZE)), int(floor(float(z)/ChunkMesh::SIZE)));
+}
 
-    add_face({0,  1, 2, 2,  3, 0}, y0 > a && z < size-1); // +z
-    add_face({4,  5, 6, 6,  7, 4}, y1 > a && z > 0); // -z
-    add_face({3,  2, 6, 6,  5, 3}, true); // +y
-    add_face({9, 11, 6, 6,  2, 9}, y2 > a && x < size-1); // +x
-    add_face({8,  3, 5, 5, 10, 8}, y3 > a && x > 0); // -x
+void add_chunk(const ChunkMesh& mesh) {
+    Chunk c {mesh.x, mesh.z, mesh.lo, mesh.hi, mesh.top};
+    ProfileScope upload(profiler, Profiler::Upload);
+    if (instanced)
+        upload_columns(c, mesh);
+    else
+        upload_blocks(c, mesh);
+    c.bytes = mesh.bytes();
+    c.used = stream_frame;
+    c.wanted = true;
+    mesh_bytes += c.bytes;
+    auto& slot = chunks[chunk_key(c.x, c.z)];
+    slot = c;
+    order.push_back(&slot);
 }
 
+void free_chunk(Chunk& c) {
+    // a new VAO may get the same name, so the cached binding must not survive
+    if (state.vao == c.vao)
+        state.bind(0);
+    gpu_memory.release(c.vbo);
+    gpu_memory.release(c.ibo);
+    glDeleteVertexArrays(1, &c.vao);
+    glDeleteBuffers(1, &c.vbo);
+    glDeleteBuffers(1, &c.ibo);
+    mesh_bytes -= c.bytes;
+}
+
+void free_chunks() {
+    for (auto& c : chunks)
+        free_chunk(c.second);
+    chunks.clear();
+    order.clear();
+    state.bind(0);
+}
+
+// a streamed world only keeps its parameters in world, chunks are made by stream()
 void gen_map() {
-    OpenSimplex::Context ctx;
-    OpenSimplex::Seed::computeContextForSeed(ctx, seed);
-
-    heightmap.clear();
-    heightmap.resize(size*size);
-    for (int x = 0; x < size; x++) {
-        auto nx = frequency*(float(x)/size);
-        for (int z = 0; z < size; z++) {
-            auto nz = frequency*(float(z)/size),
-                 n = OpenSimplex::Noise::noise2(ctx, nx, nz);
-            heightmap[x*size+z] = size*pow(n, n < 0 ? floor(exponent) : exponent);
+    TRACE_ZONE("gen_map");
+    auto start = now_ms();
+    if (saved.size && (seed != saved.seed || size != saved.size || frequency != saved.frequency || exponent != saved.exponent)) {
+        fprintf(stderr, "world parameters changed, generating instead of the loaded world\n");
+        saved = Map();
+    }
+    // an out-of-core world is always streamed, with the parameters it was generated with, a loaded one never is
+    if (tiles.size) {
+        world = Map {tiles.seed, tiles.size, tiles.frequency, tiles.exponent};
+        streaming = true;
+    } else if (saved.size) {
+        world = saved;
+        streaming = false;
+    } else
+        world = Map {seed, size, frequency, exponent};
+    free_chunks();
+    mesh_bytes = 0;
+    heights_cache.clear();
+    mesh_cache = CacheStats();
+    scheduler.reset(world, instanced, tiles.size ? &tiles : nullptr);
+    for (auto& l : clipmap.levels)
+        l.valid = false;
+    if (streaming) {
+        gen_ms = 0;
+        return;
+    }
+
+    if (!saved.size) {
+        profiler.begin(Profiler::Noise);
+        world.noise();
+        profiler.end(Profiler::Noise);
+        profiler.begin(Profiler::Shape);
+        world.shape();
+        profiler.end(Profiler::Shape);
+    }
+
+    vector<pair<int, int>> origins;
+    for (int cx = 0; cx < world.size; cx += ChunkMesh::SIZE)
+        for (int cz = 0; cz < world.size; cz += ChunkMesh::SIZE)
+            origins.push_back(make_pair(cx, cz));
+    // two chunks per worker in flight, uploaded in order between batches
+    auto& pool = TaskPool::shared();
+    batch.resize(2*max(pool.size(), 1));
+    for (size_t i = 0; i < origins.size(); i += batch.size()) {
+        auto n = min(batch.size(), origins.size()-i);
+        profiler.begin(Profiler::Mesh);
+        pool.parallel_for(0, n, [&](size_t lo, size_t hi) {
+            for (auto j = lo; j < hi; j++)
+                batch[j].build(world, origins[i+j].first, origins[i+j].second, instanced);
+        }, 1);
+        profiler.end(Profiler::Mesh);
+        for (size_t j = 0; j < n; j++)
+            add_chunk(batch[j]);
+    }
+    gen_ms = now_ms()-start;
+}
+
+// queues the missing chunks within stream_radius, uploads finished ones and evicts meshes, then heightmaps, over budget.
+// Chunks stay wanted until they are stream_hysteresis chunks beyond the radius, so the boundary does not thrash
+void stream() {
+    TRACE_ZONE("stream");
+    stream_frame++;
+    auto eye = position/block_size;
+    auto center = chunk_key(int(floor(eye.x)), int(floor(eye.z)));
+    auto r = stream_radius,
+         keep = stream_radius+stream_hysteresis;
+    auto distance2 = [&](ChunkKey k) {
+        auto dx = k.first-center.first,
+             dz = k.second-center.second;
+        return dx*dx + dz*dz;
+    };
+
+    // a chunk coming back into range while still resident is a hit
+    for (auto& c : chunks) {
+        auto d2 = distance2(c.first);
+        if (d2 <= r*r) {
+            c.second.used = stream_frame;
+            if (!c.second.wanted)
+                mesh_cache.hits++;
+            c.second.wanted = true;
+        } else if (d2 > keep*keep)
+            c.second.wanted = false;
+    }
+
+    // tiles the camera is heading for are read ahead, hinted again only once that moves a tile.
+    // The budget is set first, fetches below already count against it
+    if (tiles.size) {
+        tiles.budget(size_t(tile_budget_mb) << 20);
+        static ChunkKey hinted(INT_MIN, INT_MIN);
+        auto ahead = vec2(eye.x, eye.z) + normalize(vec2(direction.x, direction.z)+vec2(1e-6f))*float(r*ChunkMesh::SIZE);
+        auto key = make_pair(int(floor(ahead.x))/tiles.tile, int(floor(ahead.y))/tiles.tile);
+        if (key != hinted)
+            tiles.prefetch(int(ahead.x), int(ahead.y), r*ChunkMesh::SIZE);
+        hinted = key;
+    }
+
+    // reprioritized every frame, queued jobs that left the radius are cancelled
+    vector<pair<float, ChunkKey>> missing;
+    for (int x = center.first-r; x <= center.first+r; x++)
+        for (int z = center.second-r; z <= center.second+r; z++) {
+            auto key = make_pair(x, z);
+            auto outside = tiles.size && (x < 0 || z < 0 || x*ChunkMesh::SIZE >= tiles.size || z*ChunkMesh::SIZE >= tiles.size);
+            if (distance2(key) <= r*r && !outside && !chunks.count(key))
+                missing.push_back(make_pair(ChunkScheduler::priority(key, eye, direction), key));
         }
+    scheduler.update(missing, [](ChunkScheduler::Job& job) {
+        mesh_cache.misses++;
+        if (auto heights = heights_cache.find(job.key, stream_frame))
+            job.heights = *heights;
+    });
+
+    // at least one upload a frame, more while under the byte budget
+    size_t uploaded = 0;
+    ChunkScheduler::Result done;
+    while (uploaded < size_t(upload_budget_kb) << 10 && scheduler.take(done)) {
+        if (distance2(done.key) > keep*keep) {
+            scheduler.cancelled++;
+            continue;
+        }
+        if (done.generated)
+            heights_cache.insert(done.key, done.heights, stream_frame);
+        profiler.add(Profiler::Noise, done.noise_ms);
+        profiler.add(Profiler::Shape, done.shape_ms);
+        profiler.add(Profiler::Mesh, done.mesh_ms);
+        add_chunk(done.mesh);
+        uploaded += done.mesh.bytes();
     }
 
-    vertices.clear();
-    indices.clear();
-    uvs.clear();
-    for (int x = 0; x < size; x++)
-        for (int z = 0; z < size; z++)
-            add_block(x, z);
+    mesh_cache.budget = size_t(gpu_budget_mb) << 20;
+    while (mesh_bytes > mesh_cache.budget) {
+        auto worst = chunks.end();
+        float worst_score = -1;
+        for (auto c = chunks.begin(); c != chunks.end(); ++c) {
+            if (c->second.wanted)
+                continue;
+            auto s = HeightCache::score(stream_frame-c->second.used, sqrt(float(distance2(c->first))));
+            if (s > worst_score) {
+                worst = c;
+                worst_score = s;
+            }
+        }
+        if (worst == chunks.end())
+            break;
+        free_chunk(worst->second);
+        order.erase(find(order.begin(), order.end(), &worst->second));
+        chunks.erase(worst);
+        mesh_cache.evictions++;
+    }
+    mesh_cache.bytes = mesh_bytes;
 
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(float), &vertices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(int), &indices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, uvo);
-    glBufferData(GL_ARRAY_BUFFER, uvs.size()*sizeof(vec2), &uvs[0], GL_STATIC_DRAW);
+    // heightmaps outlive their meshes, those with a mesh are never evicted
+    heights_cache.stats.budget = size_t(cpu_budget_mb) << 20;
+    heights_cache.trim(center, stream_frame, [](ChunkKey k) { return chunks.count(k) > 0; });
 }
 
-mat4 get_matrix() {
+// terrain height at a block, false outside a fixed or tiled map
+bool ground(int x, int z, float& y) {
+    if (tiles.size) {
+        if (x < 0 || x >= tiles.size || z < 0 || z >= tiles.size)
+            return false;
+        y = tiles.at(x, z);
+        return true;
+    }
+    if (streaming) {
+        Map probe {world.seed, 1, world.frequency, world.exponent, x, z, float(world.size)};
+        probe.noise();
+        probe.shape();
+        y = probe.heights[0];
+        return true;
+    }
+    if (x < 0 || x >= world.size || z < 0 || z >= world.size)
+        return false;
+    y = world.at(x, z);
+    return true;
+}
+
+void look(vec3& right, vec3& up) {
+    right = vec3(
+        sin(yaw-3.14f/2),
+        0,
+        cos(yaw-3.14f/2)
+    );
+    direction = vec3(
+        cos(pitch)*sin(yaw),
+        sin(pitch),
+        cos(pitch)*cos(yaw)
+    );
+    up = cross(right, direction);
+}
+
+void move_camera() {
     static auto last_time = glfwGetTime();
     auto now = glfwGetTime();
 
@@ -256,21 +761,9 @@ mat4 get_matrix() {
         pitch = pitch < -max ? -max :
             pitch > max ? max :
             pitch;
-    }
 
-    vec3 right, up;
-    right = vec3(
-        sin(yaw-3.14f/2),
-        0,
-        cos(yaw-3.14f/2)
-    );
-    direction = vec3(
-        cos(pitch)*sin(yaw),
-        sin(pitch),
-        cos(pitch)*cos(yaw)
-    );
-    up = cross(right, direction);
-    if (!cursor) {
+        vec3 right, up;
+        look(right, up);
         auto s = speed*float(now - last_time);
         if (glfwGetKey(win, GLFW_KEY_W) == GLFW_PRESS) position += s*direction;
         if (glfwGetKey(win, GLFW_KEY_A) == GLFW_PRESS) position -= s*right;
@@ -279,29 +772,263 @@ mat4 get_matrix() {
     }
 
     last_time = now;
-    return perspective(radians(fov), float(width/height), 0.01f, 10000.f) *
+}
+
+// puts the camera where the replayed path is after frame fixed steps, false past its end
+bool replay_camera(int frame) {
+    auto t = frame*replay_step;
+    if (t > camera_path.duration())
+        return false;
+    auto s = camera_path.at(t);
+    position = s.position;
+    yaw = s.yaw;
+    pitch = s.pitch;
+    return true;
+}
+
+bool clipmap_drawn() {
+    return streaming && clipmap_on && !overdraw;
+}
+
+// level 0 reaches twice as far as the chunks drawn in its middle
+int clipmap_spacing() {
+    auto reach = 2*(int(stream_radius/sqrt(2.f))+1)*ChunkMesh::SIZE,
+         spacing = 1;
+    while (Clipmap::HALF*spacing < reach)
+        spacing *= 2;
+    return spacing;
+}
+
+// blocks from the camera to the edge of the coarsest level
+float clipmap_reach() {
+    return Clipmap::HALF*float(clipmap_spacing() << (clipmap_levels-1));
+}
+
+mat4 get_matrix() {
+    vec3 right, up;
+    look(right, up);
+    // the near plane moves out with the far one to keep depth precision
+    auto near = 0.01f,
+         far = 10000.f;
+    if (clipmap_drawn()) {
+        near = 1;
+        far = max(far, 1.5f*block_size*clipmap_reach());
+    }
+    return perspective(radians(fov), float(width/height), near, far) *
         lookAt(position, position+direction, up) *
-        scale(mat4(1), vec3(5));
+        scale(mat4(1), vec3(block_size));
+}
+
+float chunk_distance(const Chunk& c, vec3 p) {
+    return distance(p, clamp(p, c.lo, c.hi));
+}
+
+// the square of whole chunks inside the stream radius, left to the chunks. Under a clipmap only chunks
+// inside it are drawn, those streamed between it and the radius would overlap the clipmap
+vec4 clipmap_hole() {
+    auto eye = position/block_size;
+    auto center = chunk_key(int(floor(eye.x)), int(floor(eye.z)));
+    auto k = int(stream_radius/sqrt(2.f));
+    return vec4((center.first-k)*ChunkMesh::SIZE, (center.second-k)*ChunkMesh::SIZE,
+        (center.first+k+1)*ChunkMesh::SIZE, (center.second+k+1)*ChunkMesh::SIZE) - 0.5f;
+}
+
+void cull(const mat4& mvp) {
+    ProfileScope scope(profiler, Profiler::Cull);
+    auto start = now_ms();
+    auto eye = position/block_size;
+    // proxies are only solid when seen from above the terrain
+    float y;
+    auto underground = ground(int(round(eye.x)), int(round(eye.z)), y) && eye.y < y+0.5f;
+    // cached meshes beyond the stream radius are kept, not drawn
+    auto hole = clipmap_drawn() ? clipmap_hole() : vec4(-FLT_MAX, -FLT_MAX, FLT_MAX, FLT_MAX);
+    auto drawn = [&](const Chunk& c) {
+        return c.wanted && c.lo.x >= hole.x && c.lo.z >= hole.y && c.hi.x <= hole.z && c.hi.z <= hole.w;
+    };
+
+    // the camera moves little between frames, so last frame's order is nearly sorted
+    for (auto& c : chunks)
+        c.second.distance = chunk_distance(c.second, eye);
+    for (size_t i = 1; i < order.size(); i++) {
+        auto c = order[i];
+        auto j = i;
+        for (; j > 0 && order[j-1]->distance > c->distance; j--)
+            order[j] = order[j-1];
+        order[j] = c;
+    }
+
+    visible.clear();
+    occluders = 0;
+    occlusion.clear(mvp);
+    if (occlusion_culling && !underground)
+        for (size_t i = 0; i < order.size() && i < max_occluders; i++) {
+            auto& c = *order[i];
+            if (!drawn(c))
+                continue;
+            // the edge of a fixed map or tiled world is open, so its walls must not occlude
+            auto endless = streaming && !tiles.size;
+            int faces = Occlusion::PosY;
+            if (endless || c.x > 0) faces |= Occlusion::NegX;
+            if (endless || c.x+ChunkMesh::SIZE < world.size) faces |= Occlusion::PosX;
+            if (endless || c.z > 0) faces |= Occlusion::NegZ;
+            if (endless || c.z+ChunkMesh::SIZE < world.size) faces |= Occlusion::PosZ;
+            occluders += occlusion.add_box(c.lo, vec3(c.hi.x, c.top, c.hi.z), faces);
+        }
+    occlusion.build();
+
+    auto& counters = state.counters;
+    auto next = chunks.begin();
+    for (size_t i = 0; i < order.size(); i++) {
+        auto& c = front_to_back ? *order[i] : (next++)->second;
+        if (!drawn(c))
+            continue;
+        switch (occlusion.test(c.lo, c.hi)) {
+        case Occlusion::Visible: visible.push_back(&c); break;
+        case Occlusion::Outside: counters[FrameCounters::ChunksFrustumCulled]++; break;
+        case Occlusion::Occluded: counters[FrameCounters::ChunksOccluded]++; break;
+        }
+    }
+    counters[FrameCounters::ChunksVisible] += visible.size();
+    cull_ms = now_ms()-start;
+}
+
+void clipmap_reset(int spacing) {
+    clipmap.reset(clipmap_levels, spacing);
+    glActiveTexture(GL_TEXTURE1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, Clipmap::SIDE, Clipmap::SIDE, clipmap_levels, 0, GL_RED, GL_FLOAT, nullptr);
+    glActiveTexture(GL_TEXTURE0);
+    gpu_memory.bytes[GpuMemory::Clipmap] += size_t(clipmap_levels-clipmap_layers)*Clipmap::SIDE*Clipmap::SIDE*sizeof(float);
+    clipmap_layers = clipmap_levels;
+}
+
+// moves the levels with the camera, uploads the texels that changed and draws the levels finest first
+void draw_clipmap(const mat4& mvp) {
+    ProfileScope scope(profiler, Profiler::Clipmap);
+    auto spacing = clipmap_spacing();
+    if (int(clipmap.levels.size()) != clipmap_levels || clipmap.levels[0].spacing != spacing)
+        clipmap_reset(spacing);
+    auto eye = position/block_size;
+    clipmap.update(eye.x, eye.z, world, tiles.size ? &tiles : nullptr);
+
+    glActiveTexture(GL_TEXTURE1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, Clipmap::SIDE);
+    for (auto& u : clipmap.updates) {
+        auto& l = clipmap.levels[u.level];
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, u.u, u.v, u.level, u.w, u.h, 1, GL_RED, GL_FLOAT,
+            &l.heights[size_t(u.v)*Clipmap::SIDE+u.u]);
+        gpu_memory.uploaded += size_t(u.w)*u.h*sizeof(float);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glActiveTexture(GL_TEXTURE0);
+
+    auto& program = clipmap_gl;
+    state.use(program.id);
+    state.uniform(program.mvp_u, mvp);
+    state.uniform(program.size_u, GLfloat(world.size));
+    state.uniform(program.thresholds_u, thresholds.data(), thresholds.size());
+    state.uniform(program.texture_u, 0);
+    state.uniform(program.heights_u, 1);
+    state.uniform(program.edge_u, Clipmap::GRID-1);
+    state.uniform(program.extent_u, GLfloat(tiles.size));
+    state.bind_texture(texture);
+    state.bind(clipmap_vao);
+    for (int i = 0; i < clipmap_levels; i++) {
+        auto& l = clipmap.levels[i];
+        state.uniform(program.corner_u, ivec2(l.x, l.z));
+        state.uniform(program.level_u, i);
+        state.uniform(program.spacing_u, GLfloat(l.spacing));
+        state.uniform(program.hole_u, i ? clipmap.bounds(i-1) : clipmap_hole());
+        // level 0 is whole, the others are rings around the level inside them
+        if (i)
+            state.draw(clipmap_count-GLsizei(clipmap_ring), clipmap_ring);
+        else
+            state.draw(clipmap_count);
+    }
 }
 
 void render() {
-    glUseProgram(block_gl);
-    glUniformMatrix4fv(mvp_u, 1, false, &get_matrix()[0][0]);
-    glUniform1i(texture_u, 0);
+    ProfileScope scope(profiler, Profiler::Render);
+    if (streaming)
+        stream();
+    profiler.begin(Profiler::Matrix);
+    auto mvp = get_matrix();
+    profiler.end(Profiler::Matrix);
+    cull(mvp);
+    auto& program = overdraw ? (instanced ? column_overdraw_gl : block_overdraw_gl) :
+        instanced ? column_gl : block_gl;
+    state.use(program.id);
+    state.uniform(program.mvp_u, mvp);
+    state.uniform(program.size_u, GLfloat(world.size));
+    state.uniform(program.thresholds_u, thresholds.data(), thresholds.size());
+    if (!overdraw) {
+        state.uniform(program.texture_u, 0);
+        state.bind_texture(texture);
+    } else {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+    }
 
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, nullptr);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, uvo);
-    glVertexAttribPointer(1, 2, GL_FLOAT, false, 0, nullptr);
-    glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, nullptr);
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
+    profiler.gpu_begin();
+    for (auto c : visible) {
+        state.uniform(program.origin_u, vec3(c->x, 0, c->z));
+        state.bind(c->vao);
+        if (instanced)
+            state.draw_instanced(sizeof(Column::CUBE_INDICES), c->count);
+        else
+            state.draw(c->count);
+    }
+    if (clipmap_drawn())
+        draw_clipmap(mvp);
+    profiler.gpu_end();
+
+    if (overdraw) {
+        glDisable(GL_BLEND);
+        vector<unsigned char> counts(width*height);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, counts.data());
+        size_t fragments = 0, pixels = 0;
+        for (auto n : counts) {
+            fragments += n;
+            pixels += n > 0;
+        }
+        fragments_per_pixel = pixels ? float(fragments)/pixels : 0;
+    }
+}
+
+template<class T> void memory_row(const char* name, const vector<T>& v) {
+    ImGui::Text("%s: %.2f / %.2f MB", name, v.size()*sizeof(T)/1048576.0, v.capacity()*sizeof(T)/1048576.0);
+}
+
+void memory_ui() {
+    if (!ImGui::CollapsingHeader("memory"))
+        return;
+    const auto mb = 1048576.0;
+    ImGui::Text("cpu, used / reserved");
+    memory_row("heights", world.heights);
+    size_t used = 0, reserved = 0;
+    for (auto& m : batch) {
+        used += m.bytes();
+        reserved += m.vertices.capacity()*sizeof(float) + m.indices.capacity()*sizeof(int) + m.columns.capacity()*sizeof(Column);
+    }
+    ImGui::Text("mesh batch: %.2f / %.2f MB", used/mb, reserved/mb);
+    // a map node is about four pointers besides the chunk
+    ImGui::Text("chunks: %.2f MB", chunks.size()*(sizeof(Chunk)+4*sizeof(void*))/mb);
+    ImGui::Text("cull lists: %.2f MB, depth buffer: %.2f MB",
+        (order.capacity()+visible.capacity())*sizeof(Chunk*)/mb, occlusion.bytes()/mb);
+
+    const char* names[] = {"vertices", "indices", "columns", "cube", "clipmap"};
+    ImGui::Text("gpu buffers: %.2f MB", gpu_memory.total()/mb);
+    for (int i = 0; i < GpuMemory::CATEGORIES; i++)
+        ImGui::Text("  %s: %.2f MB", names[i], gpu_memory.bytes[i]/mb);
+
+    auto process = Memory::process();
+    ImGui::Text("rss: %.1f MB, peak %.1f MB", process.rss/mb, process.peak_rss/mb);
+    ImGui::Text("size %d needs %.1f MB heights, up to %.1f MB meshes", size,
+        Memory::map_bytes(size)/mb, Memory::mesh_bytes(size, instanced)/mb);
 }
 
 void render_ui() {
+    ProfileScope scope(profiler, Profiler::Ui);
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
@@ -313,9 +1040,42 @@ void render_ui() {
     ImGui::InputInt("size", &size);
     ImGui::SliderFloat("frequency", &frequency, 1, 7, nullptr);
     ImGui::SliderFloat("exponent", &exponent, 1, 7, nullptr);
+    const char* materials[] = {"shallow water", "grass", "forest", "stone", "snow"};
+    for (int i = 0; i < 5; i++)
+        ImGui::SliderFloat(materials[i], &thresholds[i], -1, 1, "%.2f");
     if (ImGui::Button("reseed")) reseed();
     ImGui::SameLine(); 
     if (ImGui::Button("generate map")) gen_map();
+    if (ImGui::Checkbox("instanced", &instanced)) gen_map();
+    ImGui::SameLine();
+    if (ImGui::Checkbox("streaming", &streaming)) gen_map();
+    if (streaming) {
+        ImGui::SliderInt("stream radius", &stream_radius, 1, 48);
+        ImGui::SliderInt("upload KB per frame", &upload_budget_kb, 64, 16384);
+        ImGui::Text("jobs: %zu reading, %zu queued, %zu running, %zu cancelled, %zu failed", scheduler.reading(),
+            scheduler.queued(), scheduler.in_flight(), scheduler.cancelled, size_t(scheduler.failed));
+        ImGui::SliderInt("cpu budget MB", &cpu_budget_mb, 1, 1024);
+        ImGui::SliderInt("gpu budget MB", &gpu_budget_mb, 1, 4096);
+        auto cache_row = [](const char* name, const CacheStats& c) {
+            ImGui::Text("%s: %.1f%% hits, %zu evictions, %.1f / %.0f MB", name,
+                100*c.hit_rate(), c.evictions, c.bytes/1048576.0, c.budget/1048576.0);
+        };
+        cache_row("heightmaps", heights_cache.stats);
+        cache_row("meshes", mesh_cache);
+        if (tiles.size) {
+            ImGui::SliderInt("tile budget MB", &tile_budget_mb, 1, 8192);
+            cache_row("tiles", tiles.stats());
+        }
+        ImGui::Checkbox("clipmap", &clipmap_on);
+        if (clipmap_on) {
+            ImGui::SliderInt("clipmap levels", &clipmap_levels, 1, 10);
+            ImGui::Text("clipmap: %d blocks spacing, reaching %.0f blocks", clipmap_spacing(), clipmap_reach());
+        }
+    }
+    ImGui::Checkbox("occlusion culling", &occlusion_culling);
+    ImGui::Checkbox("front to back", &front_to_back);
+    ImGui::SameLine();
+    ImGui::Checkbox("overdraw", &overdraw);
     ImGui::Separator();
 
     ImGui::SliderFloat("sensitivity", &sensitivity, 0.0001, 0.001, nullptr);
@@ -324,11 +1084,21 @@ void render_ui() {
     ImGui::Separator();
 
     auto io = ImGui::GetIO();
-    ImGui::Text("fps: %.2f", io.Framerate);
+    ImGui::Text("fps: %.2f (%.2f ms)", io.Framerate, 1000/io.Framerate);
+    ImGui::Text("gen: %.2f ms, mesh: %.2f MB", gen_ms, mesh_bytes/1048576.0);
+    auto& last = state.counters.last;
+    ImGui::Text("chunks: %d, gl calls: %zu (%zu elided)", int(chunks.size()),
+        last[FrameCounters::DrawCalls]+last[FrameCounters::StateChanges], last[FrameCounters::Elided]);
+    ImGui::Text("culled: %zu frustum, %zu occluded by %d, %.2f ms",
+        last[FrameCounters::ChunksFrustumCulled], last[FrameCounters::ChunksOccluded], occluders, cull_ms);
+    if (overdraw) ImGui::Text("overdraw: %.2f fragments per covered pixel", fragments_per_pixel);
     ImGui::Text("yaw: %.2f", degrees(yaw));
     ImGui::Text("pitch: %.2f", degrees(pitch));
     ImGui::Text("position: %.2f, %.2f, %.2f", position.x, position.y, position.z);
     ImGui::Text("direction: %.2f, %.2f, %.2f", direction.x, direction.y, direction.z);
+    profiler.draw_ui();
+    state.counters.draw_ui();
+    memory_ui();
     ImGui::Separator();
 
     ImGui::Text("ESC - toggle input");
@@ -345,25 +1115,76 @@ void render_ui() {
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
-int main() {
-    srand(time(0));
-    reseed();
+// uploads happen outside render, so they are folded in when the frame closes
+void next_frame() {
+    state.counters[FrameCounters::UploadedBytes] += gpu_memory.uploaded;
+    gpu_memory.uploaded = 0;
+    state.counters.next_frame();
+    profiler.next_frame();
+}
 
-    glfw_init();
-    if (win == nullptr) 
+#ifdef COMANCHE_EGL
+int egl_init() {
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+        egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (egl_display == EGL_NO_DISPLAY)
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (!eglInitialize(egl_display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "egl init failed, error 0x%x\n", eglGetError());
         return 1;
+    }
 
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    ImGui_ImplGlfw_InitForOpenGL(win, false);
-    ImGui_ImplOpenGL3_Init("#version 150");
-    ImGui::StyleColorsDark();
+    const EGLint config_attribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint n;
+    if (eglChooseConfig(egl_display, config_attribs, &config, 1, &n) && n == 1)
+        egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+    if (egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+        fprintf(stderr, "egl context creation failed, error 0x%x\n", eglGetError());
+        return 1;
+    }
 
+    glewExperimental = true; // core profile
+    // glew checks for a GLX display after loading the entry points, and headless has none
+    auto err = glewInit();
+    if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
+        fprintf(stderr, "glew init failed\n");
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// headless frames go to an offscreen framebuffer of a fixed size
+void fbo_init(int w, int h) {
+    width = w;
+    height = h;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &fbo_color);
+    glBindRenderbuffer(GL_RENDERBUFFER, fbo_color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, fbo_color);
+    glGenRenderbuffers(1, &fbo_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, fbo_depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, fbo_depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "offscreen framebuffer incomplete\n");
+}
+
+void gl_init() {
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
     glDepthFunc(GL_LESS);
 
-    GLuint texture;
     glGenTextures(1, &texture);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
@@ -371,25 +1192,438 @@ int main() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     load_texture("textures.png");
 
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    glGenBuffers(1, &cube_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, cube_vbo);
+    gpu_memory.buffer_data(GL_ARRAY_BUFFER, cube_vbo, GpuMemory::Cube, sizeof(Column::CUBE), Column::CUBE);
+    glGenBuffers(1, &cube_ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_ibo);
+    gpu_memory.buffer_data(GL_ELEMENT_ARRAY_BUFFER, cube_ibo, GpuMemory::Cube, sizeof(Column::CUBE_INDICES), Column::CUBE_INDICES);
 
-    glGenBuffers(1, &vbo);
-    glGenBuffers(1, &ibo);
-    glGenBuffers(1, &uvo);
+    block_gl = load_program(Program::BLOCK_SHADER, Program::FRAGMENT_SHADER);
+    column_gl = load_program(Program::COLUMN_SHADER, Program::FRAGMENT_SHADER);
+    block_overdraw_gl = load_program(Program::BLOCK_SHADER, Program::OVERDRAW_SHADER);
+    column_overdraw_gl = load_program(Program::COLUMN_SHADER, Program::OVERDRAW_SHADER);
+    clipmap_gl = load_program(Program::CLIPMAP_SHADER, Program::CLIPMAP_FRAGMENT_SHADER);
+
+    // the height texture stays bound to unit 1, levels are allocated on first draw
+    glGenTextures(1, &clipmap_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, clipmap_texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glActiveTexture(GL_TEXTURE0);
 
-    block_gl = load_glsl(Block::VERTEX_SHADER, Block::FRAGMENT_SHADER);
-    mvp_u = glGetUniformLocation(block_gl, "mvp");
-    texture_u = glGetUniformLocation(block_gl, "texture");
+    vector<int16_t> xz;
+    vector<uint32_t> indices;
+    Clipmap::mesh(xz, indices, clipmap_ring);
+    clipmap_count = indices.size();
+    glGenVertexArrays(1, &clipmap_vao);
+    state.bind(clipmap_vao);
+    glGenBuffers(1, &clipmap_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, clipmap_vbo);
+    gpu_memory.buffer_data(GL_ARRAY_BUFFER, clipmap_vbo, GpuMemory::Clipmap, xz.size()*sizeof(int16_t), xz.data());
+    glEnableVertexAttribArray(0);
+    glVertexAttribIPointer(0, 2, GL_SHORT, 0, nullptr);
+    glGenBuffers(1, &clipmap_ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clipmap_ibo);
+    gpu_memory.buffer_data(GL_ELEMENT_ARRAY_BUFFER, clipmap_ibo, GpuMemory::Clipmap, indices.size()*sizeof(uint32_t), indices.data());
+}
+
+// stops reads before the statics they complete into are destroyed, the task pool may go first
+void streaming_free() {
+    scheduler.reset(world, instanced);
+    tiles.close();
+    IoQueue::shared().close();
+}
+
+void gl_free() {
+    streaming_free();
+    free_chunks();
+    gpu_memory.release(cube_vbo);
+    gpu_memory.release(cube_ibo);
+    glDeleteBuffers(1, &cube_vbo);
+    glDeleteBuffers(1, &cube_ibo);
+    glDeleteTextures(1, &texture);
+    gpu_memory.release(clipmap_vbo);
+    gpu_memory.release(clipmap_ibo);
+    glDeleteBuffers(1, &clipmap_vbo);
+    glDeleteBuffers(1, &clipmap_ibo);
+    glDeleteVertexArrays(1, &clipmap_vao);
+    glDeleteTextures(1, &clipmap_texture);
+    gpu_memory.bytes[GpuMemory::Clipmap] -= size_t(clipmap_layers)*Clipmap::SIDE*Clipmap::SIDE*sizeof(float);
+    clipmap_layers = 0;
+    clipmap.levels.clear();
+    for (auto& p : {block_gl, column_gl, block_overdraw_gl, column_overdraw_gl, clipmap_gl})
+        glDeleteProgram(p.id);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &fbo_color);
+    glDeleteRenderbuffers(1, &fbo_depth);
+}
+
+void clear() {
+    glViewport(0, 0, width, height);
+    if (overdraw)
+        glClearColor(0, 0, 0, 0);
+    else
+        glClearColor(sky_color.x, sky_color.y, sky_color.z, sky_color.w);
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+}
 
+double percentile(vector<double> v, double p) {
+    sort(v.begin(), v.end());
+    return v[size_t(p*(v.size()-1)+0.5)];
+}
+
+// counts frames only, not the initial upload or load
+void reset_counters() {
+    state.counters = FrameCounters();
+    gpu_memory.uploaded = 0;
+    io_bytes = IoQueue::shared().stats().bytes;
+}
+
+// prints frame time statistics and counters as one JSON line
+void report(const vector<double>& ms) {
+    auto total = 0.0;
+    for (auto t : ms)
+        total += t;
+    auto process = Memory::process();
+    printf("{\"seed\": %d, \"size\": %d, \"instanced\": %s, \"streaming\": %s, \"camera\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, "
+        "\"gen_ms\": %.3f, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"triangles_per_s\": %.0f, "
+        "\"chunks\": %d, \"heights_bytes\": %zu, \"gpu_bytes\": %zu, \"rss_bytes\": %zu, \"peak_rss_bytes\": %zu, \"counters\": ",
+        world.seed, world.size, instanced ? "true" : "false", streaming ? "true" : "false", replaying ? "replay" : "orbit", width, height, int(ms.size()),
+        gen_ms, total/ms.size(), percentile(ms, 0.5), percentile(ms, 0.99),
+        state.counters.total[FrameCounters::Triangles]/(total/1000),
+        int(chunks.size()), world.heights.capacity()*sizeof(float), gpu_memory.total(), process.rss, process.peak_rss);
+    state.counters.print_json(stdout);
+    if (streaming) {
+        auto print_cache = [](const char* name, const CacheStats& c) {
+            printf(", \"%s\": {\"hit_rate\": %.4f, \"evictions\": %zu, \"bytes\": %zu, \"budget\": %zu}",
+                name, c.hit_rate(), c.evictions, c.bytes, c.budget);
+        };
+        print_cache("heightmap_cache", heights_cache.stats);
+        print_cache("mesh_cache", mesh_cache);
+        if (tiles.size)
+            print_cache("tile_cache", tiles.stats());
+        printf(", \"clipmap_levels\": %d", clipmap_drawn() ? clipmap_levels : 0);
+    }
+    auto io = IoQueue::shared().stats();
+    printf(", \"io\": {\"backend\": \"%s\", \"requests\": %zu, \"max_depth\": %zu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"mb_s\": %.2f}",
+        IoQueue::NAMES[io.backend], io.requests, io.max_depth, io.p50_us, io.p99_us, (io.bytes-io_bytes)/1048576.0/(total/1000));
+    printf("}\n");
+}
+
+// puts the camera where a replayed path or one orbit around the map is at frame i
+void place_camera(int i, int frames) {
+    if (replaying) {
+        replay_camera(i);
+        return;
+    }
+    auto center = vec3(world.size/2.f, 0, world.size/2.f);
+    auto t = 2*3.14159265f*i/frames;
+    auto eye = center + world.size*vec3(0.75f*cos(t), 0.5f, 0.75f*sin(t)),
+         to = normalize(center-eye);
+    position = block_size*eye;
+    yaw = atan2(to.x, to.z);
+    pitch = asin(to.y);
+}
+
+int headless_init(int w, int h) {
+#ifdef COMANCHE_EGL
+    if (egl_init())
+        return 1;
+#else
+    fprintf(stderr, "built without EGL, --headless is not available\n");
+    return 1;
+#endif
+    gl_init();
+    fbo_init(w, h);
+    return 0;
+}
+
+void headless_free() {
+    gl_free();
+#ifdef COMANCHE_TRACE
+    Trace::write("trace.json");
+#endif
+#ifdef COMANCHE_EGL
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display);
+#endif
+}
+
+// renders a replayed path or one orbit around the map offscreen
+int run_headless(int frames, int w, int h) {
+    if (headless_init(w, h))
+        return 1;
+    gen_map();
+    reset_counters();
+
+    vector<double> ms;
+    for (int i = 0; i < frames; i++) {
+        place_camera(i, frames);
+        TRACE_ZONE("frame");
+        auto start = now_ms();
+        clear();
+        render();
+        glFinish();
+        ms.push_back(now_ms()-start);
+        next_frame();
+    }
+
+    report(ms);
+    headless_free();
+    return 0;
+}
+
+// a renderer configuration the comparison harness switches between, "blocks|columns[,nocull][,unsorted]"
+class Pipeline {
+public:
+    string name;
+    bool instanced, occlusion_culling, front_to_back;
+    vector<double> ms;
+
+    bool parse(const string& arg) {
+        name = arg;
+        instanced = false;
+        occlusion_culling = front_to_back = true;
+        for (size_t i = 0, j; i <= arg.size(); i = j+1) {
+            j = min(arg.find(',', i), arg.size());
+            auto token = arg.substr(i, j-i);
+            if (token == "blocks") instanced = false;
+            else if (token == "columns") instanced = true;
+            else if (token == "nocull") occlusion_culling = false;
+            else if (token == "unsorted") front_to_back = false;
+            else return false;
+        }
+        return true;
+    }
+
+    void use() const {
+        ::instanced = instanced;
+        ::occlusion_culling = occlusion_culling;
+        ::front_to_back = front_to_back;
+    }
+};
+
+// GL rows start at the bottom, PNG rows at the top
+void write_png(const string& path, const vector<unsigned char>& rgba, int w, int h) {
+    vector<unsigned char> flipped(rgba.size());
+    for (int y = 0; y < h; y++)
+        memcpy(&flipped[y*w*4], &rgba[(h-1-y)*w*4], w*4);
+    auto err = lodepng::encode(path, flipped, w, h);
+    if (err)
+        fprintf(stderr, "writing %s failed, error %u: %s\n", path.c_str(), err, lodepng_error_text(err));
+}
+
+// renders every frame through both pipelines and compares the pictures, 2 if they differ
+int run_compare(Pipeline& a, Pipeline& b, int frames, int w, int h, int tolerance) {
+    if (headless_init(w, h))
+        return 1;
+    // both chunk sets stay resident and are swapped in for their pipeline's frames
+    decltype(chunks) parked;
+    vector<Chunk*> parked_order;
+    auto swap_chunks = [&] {
+        swap(chunks, parked);
+        swap(order, parked_order);
+    };
+    a.use();
+    gen_map();
+    swap_chunks();
+    b.use();
     gen_map();
-    while (!glfwWindowShouldClose(win)) {
+
+    size_t pixels = size_t(w)*h, mismatched = 0;
+    vector<unsigned char> pa(pixels*4), pb(pixels*4), worst_a, worst_b;
+    auto max_error = 0, mismatched_frames = 0, worst_frame = -1;
+    size_t worst_count = 0;
+    double error_sum = 0;
+    for (int i = 0; i < frames; i++) {
+        for (auto p : {&a, &b}) {
+            swap_chunks();
+            p->use();
+            place_camera(i, frames);
+            auto start = now_ms();
+            clear();
+            render();
+            glFinish();
+            p->ms.push_back(now_ms()-start);
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, (p == &a ? pa : pb).data());
+        }
+
+        size_t count = 0;
+        for (size_t j = 0; j < pixels; j++) {
+            auto d = 0;
+            for (int c = 0; c < 3; c++)
+                d = max(d, abs(pa[j*4+c]-pb[j*4+c]));
+            max_error = max(max_error, d);
+            error_sum += d;
+            count += d > tolerance;
+        }
+        mismatched += count;
+        mismatched_frames += count > 0;
+        if (count > worst_count) {
+            worst_count = count;
+            worst_frame = i;
+            worst_a = pa;
+            worst_b = pb;
+        }
+    }
+
+    // the worst frame through each pipeline, and differences in red over a dimmed first picture
+    if (worst_frame >= 0) {
+        vector<unsigned char> diff(pixels*4);
+        for (size_t j = 0; j < pixels; j++) {
+            auto d = 0;
+            for (int c = 0; c < 3; c++)
+                d = max(d, abs(worst_a[j*4+c]-worst_b[j*4+c]));
+            for (int c = 0; c < 3; c++)
+                diff[j*4+c] = worst_a[j*4+c]/4;
+            if (d > tolerance)
+                diff[j*4] = min(255, 64+d*4);
+            diff[j*4+3] = 255;
+        }
+        write_png("compare_a.png", worst_a, w, h);
+        write_png("compare_b.png", worst_b, w, h);
+        write_png("compare_diff.png", diff, w, h);
+    }
+
+    auto stats = [](const Pipeline& p) {
+        auto total = 0.0;
+        for (auto t : p.ms)
+            total += t;
+        printf("{\"pipeline\": \"%s\", \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f}",
+            p.name.c_str(), total/p.ms.size(), percentile(p.ms, 0.5), percentile(p.ms, 0.99));
+    };
+    printf("{\"seed\": %d, \"size\": %d, \"camera\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, \"a\": ",
+        seed, world.size, replaying ? "replay" : "orbit", w, h, frames);
+    stats(a);
+    printf(", \"b\": ");
+    stats(b);
+    printf(", \"tolerance\": %d, \"max_error\": %d, \"mean_error\": %.6f, \"mismatched_pixels\": %zu, "
+        "\"mismatched_frames\": %d, \"worst_frame\": %d}\n",
+        tolerance, max_error, error_sum/(double(pixels)*frames), mismatched, mismatched_frames, worst_frame);
+
+    free_chunks();
+    swap_chunks();
+    headless_free();
+    return mismatched ? 2 : 0;
+}
+
+int main(int argc, char** argv) {
+    srand(time(0));
+    reseed();
+
+    auto headless = false,
+         seeded = false;
+    auto frames = 0,
+         w = 1280,
+         h = 720;
+    const char* replay_path = nullptr;
+    const char* world_path = nullptr;
+    auto io_threads = false;
+    Pipeline compare[2];
+    auto comparing = false;
+    auto tolerance = 0;
+    for (int i = 1; i < argc; i++) {
+        auto arg = argv[i];
+        auto value = i+1 < argc ? atoi(argv[i+1]) : 0;
+        if (!strcmp(arg, "--headless")) headless = true;
+        else if (!strcmp(arg, "--instanced")) instanced = true;
+        else if (!strcmp(arg, "--stream")) streaming = true;
+        else if (!strcmp(arg, "--radius") && value > 0) stream_radius = value, i++;
+        else if (!strcmp(arg, "--cpu-budget-mb") && value > 0) cpu_budget_mb = value, i++;
+        else if (!strcmp(arg, "--gpu-budget-mb") && value > 0) gpu_budget_mb = value, i++;
+        else if (!strcmp(arg, "--upload-kb") && value > 0) upload_budget_kb = value, i++;
+        else if (!strcmp(arg, "--tile-budget-mb") && value > 0) tile_budget_mb = value, i++;
+        else if (!strcmp(arg, "--clipmap") && value > 0 && value <= 10) clipmap_on = true, clipmap_levels = value, i++;
+        else if (!strcmp(arg, "--world") && i+1 < argc) world_path = argv[++i];
+        else if (!strcmp(arg, "--io-threads")) io_threads = true;
+        else if (!strcmp(arg, "--frames") && value > 0) frames = value, i++;
+        else if (!strcmp(arg, "--width") && value > 0) w = value, i++;
+        else if (!strcmp(arg, "--height") && value > 0) h = value, i++;
+        else if (!strcmp(arg, "--size") && value > 1) size = value, i++;
+        else if (!strcmp(arg, "--seed") && i+1 < argc) seed = value, seeded = true, i++;
+        else if (!strcmp(arg, "--record") && i+1 < argc) record_path = argv[++i];
+        else if (!strcmp(arg, "--replay") && i+1 < argc) replay_path = argv[++i];
+        else if (!strcmp(arg, "--tolerance") && i+1 < argc) tolerance = value, i++;
+        else if (!strcmp(arg, "--compare") && i+2 < argc && compare[0].parse(argv[i+1]) && compare[1].parse(argv[i+2]))
+            comparing = true, i += 2;
+        else {
+            fprintf(stderr, "usage: %s [--headless] [--frames n] [--width n] [--height n] [--size n] [--seed n] [--instanced] "
+                "[--stream [--radius n] [--cpu-budget-mb n] [--gpu-budget-mb n] [--upload-kb n] [--clipmap levels]] [--world path.regions | --world path.tiles [--tile-budget-mb n]] [--io-threads] [--record path] [--replay path] [--compare a b [--tolerance n]]\n"
+                "pipelines are blocks or columns, optionally followed by ,nocull and ,unsorted\n", argv[0]);
+            return 1;
+        }
+    }
+    size = min(size, 2500);
+    if (io_threads)
+        IoQueue::shared().open(IoQueue::Threads, 64);
+    // saved worlds are whole maps, anything else a tiled world
+    auto n = world_path ? strlen(world_path) : 0;
+    auto regions = n > 8 && !strcmp(world_path+n-8, ".regions");
+    if (world_path && !(regions ? Regions::load(world_path, saved) : tiles.open(world_path))) {
+        fprintf(stderr, "opening world %s failed\n", world_path);
+        return 1;
+    }
+    // the parameters a loaded world was generated with, as if given on the command line
+    if (saved.size) {
+        seed = saved.seed;
+        seeded = true;
+        size = saved.size;
+        frequency = saved.frequency;
+        exponent = saved.exponent;
+        if (streaming)
+            fprintf(stderr, "a loaded world is whole in memory and not streamed\n");
+    }
+    if (replay_path) {
+        if (!camera_path.load(replay_path)) {
+            fprintf(stderr, "loading camera path %s failed\n", replay_path);
+            return 1;
+        }
+        replaying = true;
+    }
+    if (headless || comparing) {
+        // a fixed default seed keeps runs comparable
+        if (!seeded) seed = 0;
+        if (!frames) frames = replaying ? int(camera_path.duration()/replay_step)+1 : 300;
+        if (comparing)
+            return run_compare(compare[0], compare[1], frames, w, h, tolerance);
+        return run_headless(frames, w, h);
+    }
+
+    glfw_init();
+    if (win == nullptr) 
+        return 1;
+
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    ImGui_ImplGlfw_InitForOpenGL(win, false);
+    ImGui_ImplOpenGL3_Init("#version 150");
+    ImGui::StyleColorsDark();
+
+    gl_init();
+    gen_map();
+    // replays measure the renderer, not the display's refresh rate
+    if (replaying) {
+        glfwSwapInterval(0);
+        reset_counters();
+    }
+    vector<double> ms;
+    auto start = glfwGetTime();
+    for (int frame = 0; !glfwWindowShouldClose(win); frame++) {
+        TRACE_ZONE("frame");
+        auto frame_start = now_ms();
         glfwGetFramebufferSize(win, &width, &height);
-        glViewport(0, 0, width, height);
-        glClearColor(sky_color.x, sky_color.y, sky_color.z, sky_color.w);
-        glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+        clear();
 
+        if (!replaying)
+            move_camera();
+        else if (!replay_camera(frame))
+            break;
+        if (record_path)
+            camera_path.add(glfwGetTime()-start, position, yaw, pitch);
         render();
         render_ui();
 
@@ -398,15 +1632,22 @@ int main() {
         if (size < 2) size = 2;
         if (size > 2500) size = 2500;
 
+        profiler.begin(Profiler::Swap);
         glfwSwapBuffers(win);
+        profiler.end(Profiler::Swap);
         glfwPollEvents();
+        next_frame();
+        ms.push_back(now_ms()-frame_start);
     }
+    if (replaying && !ms.empty())
+        report(ms);
+    if (record_path && !camera_path.save(record_path))
+        fprintf(stderr, "writing camera path %s failed\n", record_path);
 
-    glDeleteVertexArrays(1, &vao);
-    glDeleteBuffers(1, &vbo);
-    glDeleteBuffers(1, &ibo);
-    glDeleteBuffers(1, &uvo);
-    glDeleteProgram(block_gl);
+    gl_free();
+#ifdef COMANCHE_TRACE
+    Trace::write("trace.json");
+#endif
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -0,0 +1,29 @@
+#include "memory.h"
+
+#include <cstdio>
+
+#include "terrain.h"
+
+Memory Memory::process() {
+    Memory m;
+    auto f = fopen("/proc/self/status", "r");
+    if (!f)
+        return m;
+    char line[256];
+    size_t kb;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %zu kB", &kb) == 1) m.rss = kb << 10;
+        else if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) m.peak_rss = kb << 10;
+    }
+    fclose(f);
+    return m;
+}
+
+size_t Memory::map_bytes(int size) {
+    return size_t(size)*size*sizeof(float);
+}
+
+size_t Memory::mesh_bytes(int size, bool instanced) {
+    const size_t block = 12*3*sizeof(float) + 30*sizeof(int);
+    return size_t(size)*size*(instanced ? sizeof(Column) : block);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// process and terrain memory figures in bytes
+class Memory {
+public:
+    size_t rss = 0, peak_rss = 0;
+
+    // VmRSS and VmHWM from /proc/self/status, zeros where there is none
+    static Memory process();
+
+    // heights of a map of this size
+    static size_t map_bytes(int size);
+    // upper bound for all chunk meshes of a map, every block with all five faces
+    static size_t mesh_bytes(int size, bool instanced);
+};
@@ -0,0 +1,180 @@
+#include "occlusion.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+const float NEAR = 0.01f;
+
+// corners of each face in counter clockwise order seen from outside, bit 0 x, bit 1 y, bit 2 z
+const int QUADS[5][4] = {
+    {5, 1, 3, 7}, // +x
+    {4, 6, 2, 0}, // -x
+    {4, 5, 7, 6}, // +z
+    {0, 2, 3, 1}, // -z
+    {6, 7, 3, 2}  // +y
+};
+
+static void corners(const mat4& mvp, vec3 lo, vec3 hi, vec4* out) {
+    for (int i = 0; i < 8; i++)
+        out[i] = mvp*vec4(i&1 ? hi.x : lo.x, i&2 ? hi.y : lo.y, i&4 ? hi.z : lo.z, 1);
+}
+
+static vec4 to_screen(const vec4& clip) {
+    return vec4(
+        (clip.x/clip.w*0.5f+0.5f)*Occlusion::WIDTH,
+        (clip.y/clip.w*0.5f+0.5f)*Occlusion::HEIGHT,
+        0,
+        clip.w
+    );
+}
+
+void Occlusion::clear(const mat4& m) {
+    mvp = m;
+    levels.resize(1);
+    levels[0].assign(WIDTH*HEIGHT, FLT_MAX);
+}
+
+bool Occlusion::add_box(vec3 lo, vec3 hi, int faces) {
+    vec4 c[8];
+    corners(mvp, lo, hi, c);
+    for (auto& v : c)
+        if (v.w < NEAR)
+            return false;
+    for (auto& v : c)
+        v = to_screen(v);
+
+    for (int f = 0; f < 5; f++) {
+        if (!(faces & 1 << f))
+            continue;
+        auto& q = QUADS[f];
+        // conservative: the whole face sits at its farthest corner
+        auto depth = max(max(c[q[0]].w, c[q[1]].w), max(c[q[2]].w, c[q[3]].w));
+        triangle(c[q[0]], c[q[1]], c[q[2]], depth);
+        triangle(c[q[2]], c[q[3]], c[q[0]], depth);
+    }
+    return true;
+}
+
+void Occlusion::triangle(const vec4& a, const vec4& b, const vec4& c, float depth) {
+    auto area = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+    if (area <= 0) // back facing
+        return;
+
+    int x0 = max(0, int(floor(min(a.x, min(b.x, c.x))))) & ~3,
+        x1 = min(WIDTH-1, int(ceil(max(a.x, max(b.x, c.x))))),
+        y0 = max(0, int(floor(min(a.y, min(b.y, c.y))))),
+        y1 = min(HEIGHT-1, int(ceil(max(a.y, max(b.y, c.y)))));
+
+    // edge functions e = dx*py - dy*px + k, positive inside
+    const vec4* v[] = {&a, &b, &c};
+    float ex[3], ey[3], ek[3];
+    for (int i = 0; i < 3; i++) {
+        auto& p = *v[i];
+        auto& q = *v[(i+1)%3];
+        ex[i] = -(q.y-p.y);
+        ey[i] = q.x-p.x;
+        ek[i] = (q.y-p.y)*p.x - (q.x-p.x)*p.y;
+    }
+
+    auto& depths = levels[0];
+    for (int y = y0; y <= y1; y++) {
+        auto py = y+0.5f;
+        auto row = &depths[y*WIDTH];
+#ifdef __SSE2__
+        auto z = _mm_set1_ps(depth),
+             zero = _mm_setzero_ps(),
+             lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        __m128 dx[3], e[3];
+        for (int i = 0; i < 3; i++)
+            dx[i] = _mm_set1_ps(ex[i]);
+        for (int x = x0; x <= x1; x += 4) {
+            auto px = _mm_add_ps(_mm_set1_ps(float(x)), lane);
+            for (int i = 0; i < 3; i++)
+                e[i] = _mm_add_ps(_mm_mul_ps(dx[i], px), _mm_set1_ps(ey[i]*py+ek[i]));
+            auto inside = _mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_and_ps(_mm_cmpge_ps(e[1], zero), _mm_cmpge_ps(e[2], zero)));
+            auto old = _mm_loadu_ps(row+x);
+            _mm_storeu_ps(row+x, _mm_or_ps(_mm_and_ps(inside, _mm_min_ps(old, z)), _mm_andnot_ps(inside, old)));
+        }
+#else
+        for (int x = x0; x <= x1; x++) {
+            auto px = x+0.5f;
+            if (ex[0]*px+ey[0]*py+ek[0] >= 0 && ex[1]*px+ey[1]*py+ek[1] >= 0 && ex[2]*px+ey[2]*py+ek[2] >= 0)
+                row[x] = min(row[x], depth);
+        }
+#endif
+    }
+}
+
+void Occlusion::build() {
+    levels.resize(1);
+    for (int w = WIDTH/2, h = HEIGHT/2; w > 0 && h > 0; w /= 2, h /= 2) {
+        auto& src = levels.back();
+        vector<float> dst(w*h);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                auto s = &src[2*y*2*w+2*x];
+                dst[y*w+x] = max(max(s[0], s[1]), max(s[2*w], s[2*w+1]));
+            }
+        levels.push_back(move(dst));
+    }
+}
+
+size_t Occlusion::bytes() const {
+    size_t n = 0;
+    for (auto& l : levels)
+        n += l.capacity()*sizeof(float);
+    return n;
+}
+
+Occlusion::Result Occlusion::test(vec3 lo, vec3 hi) const {
+    vec4 c[8];
+    corners(mvp, lo, hi, c);
+
+    // outside if every corner is beyond the same clip plane
+    for (int axis = 0; axis < 3; axis++) {
+        auto below = true, above = true;
+        for (auto& v : c) {
+            below = below && v[axis] < -v.w;
+            above = above && v[axis] > v.w;
+        }
+        if (below || above)
+            return Outside;
+    }
+
+    auto x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX, near = FLT_MAX;
+    for (auto& v : c) {
+        if (v.w < NEAR)
+            return Visible;
+        auto s = to_screen(v);
+        x0 = min(x0, s.x);
+        y0 = min(y0, s.y);
+        x1 = max(x1, s.x);
+        y1 = max(y1, s.y);
+        near = min(near, s.w);
+    }
+
+    int ix0 = clamp(int(floor(x0)), 0, WIDTH-1),
+        iy0 = clamp(int(floor(y0)), 0, HEIGHT-1),
+        ix1 = clamp(int(floor(x1)), 0, WIDTH-1),
+        iy1 = clamp(int(floor(y1)), 0, HEIGHT-1);
+
+    // pick the level where the rectangle covers at most 2x2 texels
+    int l = 0;
+    while (l+1 < int(levels.size()) && ((ix1 >> l)-(ix0 >> l) > 1 || (iy1 >> l)-(iy0 >> l) > 1))
+        l++;
+    auto& depths = levels[l];
+    auto w = WIDTH >> l;
+    for (int y = iy0 >> l; y <= iy1 >> l; y++)
+        for (int x = ix0 >> l; x <= ix1 >> l; x++)
+            if (depths[y*w+x] >= near)
+                return Visible;
+    return Occluded;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// low resolution software depth buffer for culling chunks before any GL call
+class Occlusion {
+public:
+    static const int WIDTH = 256, HEIGHT = 128;
+    enum Result {Visible, Outside, Occluded};
+    enum Face {PosX = 1, NegX = 2, PosZ = 4, NegZ = 8, PosY = 16};
+
+    // starts a frame, nothing occludes until add_box is called
+    void clear(const glm::mat4& mvp);
+
+    // rasterizes the listed faces of a box that is known to be solid,
+    // returns false and draws nothing if the box crosses the near plane
+    bool add_box(glm::vec3 lo, glm::vec3 hi, int faces);
+
+    // builds the max-depth pyramid, call once after the last add_box
+    void build();
+
+    Result test(glm::vec3 lo, glm::vec3 hi) const;
+
+    size_t bytes() const;
+
+private:
+    glm::mat4 mvp;
+    std::vector<std::vector<float>> levels;
+
+    void triangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c, float depth);
+};
@@ -0,0 +1,119 @@
+#include "perf_counters.h"
+
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char* PerfCounters::MODES[] = {"none", "hardware", "software", "rusage"};
+
+static const char* HARDWARE_NAMES[] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+// software events in the same slots, so cycles/instructions is no IPC here
+static const char* SOFTWARE_NAMES[] = {"task_clock_ns", "page_faults", "context_switches", "cpu_migrations"};
+
+PerfCounters::~PerfCounters() {
+    close();
+}
+
+#ifdef __linux__
+static int open_event(uint32_t type, uint64_t config, int leader, bool user) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = user;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+}
+
+void PerfCounters::open() {
+    static const uint64_t hardware[] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    static const uint64_t software[] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_PAGE_FAULTS, PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_CPU_MIGRATIONS
+    };
+    // the kernel counts context switches and migrations in kernel context, so software events include it
+    // where allowed. Otherwise getrusage stands in for the switches.
+    for (auto attempt : {0, 1, 2}) {
+        close();
+        auto m = attempt ? Software : Hardware;
+        auto user = attempt != 1;
+        auto ok = true;
+        for (int c = 0; ok && c < COUNTERS; c++) {
+            fds[c] = open_event(m == Hardware ? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE,
+                (m == Hardware ? hardware : software)[c], fds[0], user);
+            ok = fds[c] >= 0;
+        }
+        if (ok) {
+            mode = m;
+            switches = m == Software && user;
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            return;
+        }
+    }
+    close();
+    mode = Rusage;
+}
+
+void PerfCounters::close() {
+    for (auto& fd : fds) {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+    mode = None;
+    switches = false;
+}
+
+void PerfCounters::read(uint64_t* values) const {
+    memset(values, 0, COUNTERS*sizeof(uint64_t));
+    if (mode == Hardware || mode == Software) {
+        // one read of the group, nr followed by the values in the order they were opened
+        uint64_t group[1+COUNTERS];
+        if (::read(fds[0], group, sizeof(group)) == sizeof(group))
+            memcpy(values, group+1, sizeof(group)-sizeof(uint64_t));
+        if (switches) {
+            rusage r;
+            getrusage(RUSAGE_THREAD, &r);
+            values[CacheMisses] = r.ru_nvcsw + r.ru_nivcsw;
+            values[BranchMisses] = r.ru_nivcsw;
+        }
+    } else if (mode == Rusage) {
+        timespec t;
+        rusage r;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        getrusage(RUSAGE_THREAD, &r);
+        values[Cycles] = uint64_t(t.tv_sec)*1000000000 + t.tv_nsec;
+        values[Instructions] = r.ru_minflt + r.ru_majflt;
+        values[CacheMisses] = r.ru_nvcsw + r.ru_nivcsw;
+    }
+}
+#else
+void PerfCounters::open() {}
+
+void PerfCounters::close() {
+    mode = None;
+}
+
+void PerfCounters::read(uint64_t* values) const {
+    memset(values, 0, COUNTERS*sizeof(uint64_t));
+}
+#endif
+
+const char* PerfCounters::name(int c) const {
+    if (switches && c == BranchMisses)
+        return "involuntary_switches";
+    return mode == Hardware ? HARDWARE_NAMES[c] : SOFTWARE_NAMES[c];
+}
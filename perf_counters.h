@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+// cycles, instructions, cache and branch misses of the calling thread from perf_event_open.
+// Where the PMU is hidden, as in most VMs, software events stand in, and getrusage where
+// perf events are not allowed at all. Hardware counts are user space only, software ones include
+// the kernel where allowed, since it is what switches and migrates threads.
+class PerfCounters {
+public:
+    enum Counter {Cycles, Instructions, CacheMisses, BranchMisses, COUNTERS};
+    enum Mode {None, Hardware, Software, Rusage};
+    static const char* MODES[];
+
+    Mode mode = None;
+
+    ~PerfCounters();
+
+    // counts the calling thread from here on
+    void open();
+    void close();
+
+    // running totals since open
+    void read(uint64_t* values) const;
+
+    // what each counter measures in the current mode
+    const char* name(int c) const;
+
+private:
+    int fds[COUNTERS] = {-1, -1, -1, -1};
+    bool switches = false; // software events confined to user space, switches from getrusage instead
+};
@@ -0,0 +1,187 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+
+#include <imgui.h>
+
+#include "tasks.h"
+#include "trace.h"
+
+using namespace std;
+
+const char* Profiler::NAMES[] = {"matrix", "cull", "render", "ui", "swap", "noise", "shape", "mesh", "upload", "clipmap"};
+
+void Profiler::begin(Scope s) {
+    if (counting)
+        perf.read(start_counts[s]);
+#ifdef COMANCHE_TRACE
+    trace_start[s] = Trace::ticks();
+#endif
+    start[s] = now_ns();
+}
+
+void Profiler::end(Scope s) {
+    auto t = now_ns();
+    ms[s][frame] += (t-start[s])/1e6f;
+    last[s] = ms[s][frame];
+#ifdef COMANCHE_TRACE
+    Trace::zone(NAMES[s], trace_start[s], Trace::ticks());
+#endif
+    if (counting) {
+        uint64_t now[PerfCounters::COUNTERS];
+        perf.read(now);
+        for (int c = 0; c < PerfCounters::COUNTERS; c++) {
+            counts[s][c] += now[c]-start_counts[s][c];
+            last_counts[s][c] = counts[s][c];
+        }
+    }
+}
+
+void Profiler::add(Scope s, float t) {
+    ms[s][frame] += t;
+    last[s] = ms[s][frame];
+}
+
+void Profiler::gpu_begin() {
+    if (supported < 0) {
+        supported = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+        if (supported)
+            glGenQueries(2, queries);
+    }
+    if (!supported)
+        return;
+    // the query issued two frames ago is usually done by now, if not this frame goes untimed rather than wait
+    auto i = frame&1;
+    timing = false;
+    if (pending[i]) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        GLuint64 ns;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+        gpu_ms[frame] = ns/1e6f;
+        pending[i] = false;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+    timing = true;
+}
+
+void Profiler::gpu_end() {
+    if (!timing)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[frame&1] = true;
+}
+
+void Profiler::next_frame() {
+    auto now = now_ms();
+    frame_ms[frame] = frame_start ? float(now-frame_start) : 0;
+    frame_start = now;
+    io = IoQueue::shared().stats();
+    io_depth[frame] = float(io.depth);
+    if (now-io_since >= 500) {
+        io_mb_s = io_since ? float((io.bytes-io_bytes)/1048576.0/((now-io_since)/1000)) : 0;
+        io_bytes = io.bytes;
+        io_since = now;
+    }
+    frame = (frame+1)%FRAMES;
+    for (auto& s : ms)
+        s[frame] = 0;
+    gpu_ms[frame] = 0;
+    memset(counts, 0, sizeof(counts));
+}
+
+void Profiler::draw_ui() {
+    if (!ImGui::CollapsingHeader("profiler"))
+        return;
+
+    // oldest frame first, the frame being recorded last
+    auto offset = (frame+1)%FRAMES;
+    auto plot = [&](const char* name, const float* values) {
+        float total = 0, peak = 0;
+        for (int i = 0; i < FRAMES; i++) {
+            total += values[i];
+            peak = max(peak, values[i]);
+        }
+        char overlay[64];
+        snprintf(overlay, sizeof(overlay), "avg %.2f ms, max %.2f ms", total/FRAMES, peak);
+        ImGui::PlotHistogram(name, values, FRAMES, offset, overlay, 0, peak, ImVec2(0, 40));
+    };
+    plot("frame", frame_ms);
+    if (supported > 0)
+        plot("gpu terrain", gpu_ms);
+    for (int s = Matrix; s <= Swap; s++)
+        plot(NAMES[s], ms[s]);
+    plot(NAMES[Clipmap], ms[Clipmap]);
+
+    ImGui::Text("gen: noise %.2f, shape %.2f, mesh %.2f, upload %.2f ms",
+        last[Noise], last[Shape], last[Mesh], last[Upload]);
+
+    const int BINS = 32;
+    float hi = 0, bins[BINS] = {};
+    for (auto t : frame_ms)
+        hi = max(hi, t);
+    for (int i = 0; i < FRAMES; i++)
+        if (i != frame && hi > 0)
+            bins[min(int(frame_ms[i]/hi*BINS), BINS-1)]++;
+    char overlay[64];
+    snprintf(overlay, sizeof(overlay), "0 - %.1f ms", hi);
+    ImGui::PlotHistogram("frame times", bins, BINS, 0, overlay, 0, FLT_MAX, ImVec2(0, 60));
+
+    auto t = now_ms();
+    if (t-busy_since >= 500) {
+        vector<uint64_t> ns;
+        TaskPool::shared().busy(ns);
+        utilization.assign(ns.size(), 0);
+        if (busy.size() == ns.size())
+            for (size_t i = 0; i < ns.size(); i++)
+                utilization[i] = float((ns[i]-busy[i])/1e6/(t-busy_since));
+        busy = ns;
+        busy_since = t;
+    }
+    float total = 0;
+    for (auto u : utilization)
+        total += u;
+    snprintf(overlay, sizeof(overlay), "%d workers, %.0f%% busy", int(utilization.size()),
+        utilization.empty() ? 0 : 100*total/utilization.size());
+    ImGui::PlotHistogram("workers", utilization.data(), int(utilization.size()), 0, overlay, 0, 1, ImVec2(0, 40));
+
+    snprintf(overlay, sizeof(overlay), "%s, p50 %.0f us, p99 %.0f us, %.1f MB/s",
+        IoQueue::NAMES[io.backend], io.p50_us, io.p99_us, io_mb_s);
+    ImGui::PlotHistogram("io depth", io_depth, FRAMES, offset, overlay, 0, FLT_MAX, ImVec2(0, 40));
+
+    // a syscall per begin and end, so only on request
+    if (ImGui::Checkbox("perf counters", &counting)) {
+        if (counting)
+            perf.open();
+        else
+            perf.close();
+        memset(counts, 0, sizeof(counts));
+        memset(last_counts, 0, sizeof(last_counts));
+    }
+    if (counting) {
+        ImGui::SameLine();
+        ImGui::Text("%s", PerfCounters::MODES[perf.mode]);
+        // the group counts the render thread only, which runs just its share of the stages on the task pool
+        ImGui::Text("* render thread only, workers run the rest of the stage");
+        for (int s = 0; s < SCOPES; s++) {
+            auto& n = last_counts[s];
+            auto pooled = s == Noise || s == Shape || s == Mesh;
+            ImGui::Text("%s%s: %s %llu, %s %llu, %s %llu, %s %llu", NAMES[s], pooled ? "*" : "",
+                perf.name(0), (unsigned long long)n[0], perf.name(1), (unsigned long long)n[1],
+                perf.name(2), (unsigned long long)n[2], perf.name(3), (unsigned long long)n[3]);
+            if (perf.mode == PerfCounters::Hardware && n[PerfCounters::Cycles]) {
+                ImGui::SameLine();
+                ImGui::Text(", ipc %.2f", double(n[PerfCounters::Instructions])/n[PerfCounters::Cycles]);
+            }
+        }
+    }
+#ifdef COMANCHE_TRACE
+    if (ImGui::Button("write trace.json") && !Trace::write("trace.json"))
+        fprintf(stderr, "writing trace.json failed\n");
+#endif
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "io_queue.h"
+#include "perf_counters.h"
+
+// CPU scope times and GPU terrain time of the last FRAMES frames
+class Profiler {
+public:
+    enum Scope {Matrix, Cull, Render, Ui, Swap, Noise, Shape, Mesh, Upload, Clipmap, SCOPES};
+    static const char* NAMES[SCOPES];
+    static const int FRAMES = 300;
+
+    // ring buffers indexed by frame, the slot at frame is still being recorded
+    float ms[SCOPES][FRAMES] = {},
+          gpu_ms[FRAMES] = {},
+          frame_ms[FRAMES] = {};
+    // most recent time of each scope, for scopes that only run on some frames
+    float last[SCOPES] = {};
+    int frame = 0;
+
+    // perf counters per scope while counting is on, same frame and last semantics as ms. The group counts the
+    // calling thread, so noise, shape and mesh hold only the render thread's share of work split over the pool
+    PerfCounters perf;
+    bool counting = false;
+    uint64_t counts[SCOPES][PerfCounters::COUNTERS] = {},
+             last_counts[SCOPES][PerfCounters::COUNTERS] = {};
+
+    // share of time each worker of the shared task pool spent running tasks, over half a second
+    std::vector<float> utilization;
+
+    // requests on the shared I/O queue at the end of each frame, its latest stats and throughput over half a second
+    float io_depth[FRAMES] = {};
+    IoQueue::Stats io {};
+    float io_mb_s = 0;
+
+    // scopes may repeat within a frame and add up, each is also a trace zone
+    void begin(Scope s);
+    void end(Scope s);
+    // time measured elsewhere, such as on a worker thread
+    void add(Scope s, float ms);
+
+    // GL_TIME_ELAPSED around the terrain draw, read back two frames later once available so the GPU never stalls
+    void gpu_begin();
+    void gpu_end();
+
+    void next_frame();
+    void draw_ui();
+
+private:
+    uint64_t start[SCOPES] = {},
+             trace_start[SCOPES] = {},
+             start_counts[SCOPES][PerfCounters::COUNTERS] = {};
+    double frame_start = 0,
+           busy_since = 0,
+           io_since = 0;
+    size_t io_bytes = 0;
+    std::vector<uint64_t> busy;
+    GLuint queries[2] = {};
+    bool pending[2] = {},
+         timing = false; // a query was begun this frame
+    int supported = -1;
+};
+
+// times the enclosing block
+class ProfileScope {
+public:
+    ProfileScope(Profiler& p, Profiler::Scope s) : p(p), s(s) {
+        p.begin(s);
+    }
+
+    ~ProfileScope() {
+        p.end(s);
+    }
+
+private:
+    Profiler& p;
+    Profiler::Scope s;
+};
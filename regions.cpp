@@ -0,0 +1,263 @@
+#include "regions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lodepng.h>
+
+#include "io_queue.h"
+#include "tasks.h"
+
+using namespace std;
+
+constexpr float Regions::STEP;
+
+class Header {
+public:
+    char magic[4];
+    uint32_t version, size, region;
+    int32_t seed;
+    float frequency, exponent, step;
+    uint32_t flags;
+};
+
+static_assert(sizeof(Header) <= Regions::HEADER, "the header fits its reserved bytes");
+
+void Regions::encode(const Map& map, int x0, int z0, vector<uint8_t>& out) {
+    const int R = REGION;
+    auto last = map.size-1;
+    int32_t prev[R], row[R];
+    uint32_t zig[R], words[32*LANES];
+    out.assign(R, 0);
+    // rows and columns past the map edge repeat it, so their differences are zero
+    for (int i = 0; i < R; i++) {
+        auto x = min(x0+i, last);
+        for (int j = 0; j < R; j++)
+            row[j] = int32_t(lround(map.at(x, min(z0+j, last))/STEP));
+        uint32_t any = 0;
+        for (int j = 0; j < R; j++) {
+            auto d = row[j] - (i ? prev[j] : j ? row[j-1] : 0);
+            zig[j] = uint32_t(d) << 1 ^ uint32_t(d >> 31);
+            any |= zig[j];
+        }
+        int b = 0;
+        while (b < 32 && any >> b)
+            b++;
+        out[i] = uint8_t(b);
+
+        // value k of every lane takes bits k*b of that lane's b words
+        memset(words, 0, sizeof(words));
+        for (int k = 0; k < R/LANES; k++) {
+            auto w = k*b/32, s = k*b%32;
+            for (int l = 0; l < LANES; l++) {
+                auto v = uint64_t(zig[k*LANES+l]) << s;
+                words[w*LANES+l] |= uint32_t(v);
+                if (s+b > 32)
+                    words[(w+1)*LANES+l] |= uint32_t(v >> 32);
+            }
+        }
+        auto bytes = (const uint8_t*)words;
+        out.insert(out.end(), bytes, bytes+b*LANES*sizeof(uint32_t));
+        memcpy(prev, row, sizeof(row));
+    }
+}
+
+bool Regions::decode(const uint8_t* data, size_t n, Map& map, int x0, int z0) {
+    const int R = REGION;
+    if (n < size_t(R))
+        return false;
+    auto need = size_t(R);
+    for (int i = 0; i < R; i++) {
+        if (data[i] > 32)
+            return false;
+        need += size_t(data[i])*LANES*sizeof(uint32_t);
+    }
+    if (need != n)
+        return false;
+
+    auto p = data+R;
+    int32_t q[R];
+    uint32_t u[R], words[32*LANES];
+    auto w = min(R, map.size-x0),
+         h = min(R, map.size-z0);
+    for (int i = 0; i < w; i++) {
+        int b = data[i];
+        memcpy(words, p, b*LANES*sizeof(uint32_t));
+        p += b*LANES*sizeof(uint32_t);
+        auto mask = b == 32 ? ~0u : (1u << b)-1;
+        if (!b)
+            memset(u, 0, sizeof(u));
+        // the lane loops work on LANES consecutive words with the same shifts
+        else for (int k = 0; k < R/LANES; k++) {
+            auto o = k*b/32, s = k*b%32;
+            auto lo = words+o*LANES, hi = lo+LANES;
+            if (s+b > 32)
+                for (int l = 0; l < LANES; l++)
+                    u[k*LANES+l] = uint32_t((lo[l] >> s | uint64_t(hi[l]) << (32-s)) & mask);
+            else
+                for (int l = 0; l < LANES; l++)
+                    u[k*LANES+l] = lo[l] >> s & mask;
+        }
+        if (i)
+            for (int j = 0; j < R; j++)
+                q[j] += int32_t(u[j] >> 1 ^ (0u-(u[j] & 1)));
+        else
+            for (int j = 0; j < R; j++)
+                q[j] = (j ? q[j-1] : 0) + int32_t(u[j] >> 1 ^ (0u-(u[j] & 1)));
+        auto out = &map.heights[size_t(x0+i)*map.size+z0];
+        for (int j = 0; j < h; j++)
+            out[j] = q[j]*STEP;
+    }
+    return true;
+}
+
+bool Regions::unpack(const uint8_t* data, size_t n, bool deflate, Map& map, int x, int z) {
+    if (!deflate)
+        return decode(data, n, map, x, z);
+    vector<uint8_t> raw;
+    return !lodepng::decompress(raw, data, n) && decode(raw.data(), raw.size(), map, x, z);
+}
+
+bool Regions::compress(const Map& map, bool deflate, vector<vector<uint8_t>>& regions) {
+    auto n = (map.size+REGION-1)/REGION;
+    regions.resize(size_t(n)*n);
+    atomic<bool> ok(true);
+    TaskPool::shared().parallel_for(0, regions.size(), [&](size_t lo, size_t hi) {
+        vector<uint8_t> raw;
+        for (auto i = lo; i < hi; i++) {
+            encode(map, int(i/n)*REGION, int(i%n)*REGION, deflate ? raw : regions[i]);
+            if (deflate && lodepng::compress(regions[i], raw.data(), raw.size()))
+                ok = false;
+        }
+    }, 1);
+    return ok;
+}
+
+bool Regions::decompress(const vector<vector<uint8_t>>& regions, bool deflate, Map& map) {
+    auto n = (map.size+REGION-1)/REGION;
+    if (regions.size() != size_t(n)*n)
+        return false;
+    map.heights.resize(size_t(map.size)*map.size);
+    atomic<bool> ok(true);
+    TaskPool::shared().parallel_for(0, regions.size(), [&](size_t lo, size_t hi) {
+        for (auto i = lo; i < hi; i++)
+            if (!unpack(regions[i].data(), regions[i].size(), deflate, map, int(i/n)*REGION, int(i%n)*REGION))
+                ok = false;
+    }, 1);
+    return ok;
+}
+
+size_t Regions::bound(int size, bool deflate) {
+    auto n = size_t((size+REGION-1)/REGION);
+    auto region = size_t(REGION) + size_t(REGION)*REGION*sizeof(uint32_t);
+    // stored deflate blocks add 5 bytes per 64 KB and the zlib wrapper a few more
+    if (deflate)
+        region += region/8192 + 64;
+    return n*n*region;
+}
+
+bool Regions::save(const char* path, const Map& map, bool deflate, size_t& bytes) {
+    vector<vector<uint8_t>> regions;
+    if (!compress(map, deflate, regions))
+        return false;
+    char header[HEADER] = {};
+    Header h {{'C', 'R', 'E', 'G'}, VERSION, uint32_t(map.size), uint32_t(REGION), map.seed, map.frequency,
+        map.exponent, STEP, deflate ? uint32_t(Deflate) : 0};
+    memcpy(header, &h, sizeof(h));
+    vector<uint64_t> offsets {HEADER + (regions.size()+1)*sizeof(uint64_t)};
+    for (auto& r : regions)
+        offsets.push_back(offsets.back()+r.size());
+    bytes = offsets.back();
+
+    auto fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    // one batch, the regions written in whatever order the disk prefers
+    vector<IoQueue::Request> batch {
+        {IoQueue::Request::Write, fd, header, size_t(HEADER), 0, nullptr},
+        {IoQueue::Request::Write, fd, offsets.data(), offsets.size()*sizeof(uint64_t), uint64_t(HEADER), nullptr}};
+    for (size_t i = 0; i < regions.size(); i++)
+        if (!regions[i].empty())
+            batch.push_back({IoQueue::Request::Write, fd, regions[i].data(), regions[i].size(), offsets[i], nullptr});
+    auto ok = IoQueue::shared().run(batch);
+    return ::close(fd) == 0 && ok;
+}
+
+bool Regions::load(const char* path, Map& map) {
+    auto fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    auto size = lseek(fd, 0, SEEK_END);
+    Header h;
+    // the size is checked against the file before anything is allocated from it
+    if (size < HEADER || pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "CREG", 4) ||
+        h.version != VERSION || h.size < 2 || h.size > uint32_t(LARGEST) || h.region != uint32_t(REGION) ||
+        h.step != STEP) {
+        ::close(fd);
+        return false;
+    }
+    auto side = (int(h.size)+REGION-1)/REGION;
+    auto regions = size_t(side)*side;
+    auto table = (regions+1)*sizeof(uint64_t);
+    if (uint64_t(size) < HEADER+table) {
+        ::close(fd);
+        return false;
+    }
+    vector<uint64_t> offsets(regions+1);
+    auto ok = pread(fd, offsets.data(), table, HEADER) == ssize_t(table) && offsets[0] >= HEADER+table;
+    for (size_t i = 0; ok && i < regions; i++)
+        ok = offsets[i] <= offsets[i+1] && offsets[i+1] <= uint64_t(size);
+    if (!ok) {
+        ::close(fd);
+        return false;
+    }
+    map = Map {h.seed, int(h.size), h.frequency, h.exponent};
+
+    // every region is decoded as soon as it is read, while the others are still on their way
+    vector<vector<uint8_t>> data(regions);
+    atomic<bool> good(true);
+    mutex m;
+    condition_variable arrived;
+    deque<size_t> ready;
+    vector<IoQueue::Request> batch;
+    for (size_t i = 0; i < regions; i++) {
+        data[i].resize(size_t(offsets[i+1]-offsets[i]));
+        batch.push_back({IoQueue::Request::Read, fd, data[i].data(), data[i].size(), offsets[i], [&, i](bool read) {
+            if (!read)
+                good = false;
+            lock_guard<mutex> hold(m);
+            ready.push_back(i);
+            arrived.notify_one();
+        }});
+    }
+    map.heights.resize(size_t(map.size)*map.size);
+    auto& pool = TaskPool::shared();
+    IoQueue::shared().submit(batch);
+    vector<TaskPool::Handle> decodes;
+    for (size_t k = 0; k < regions; k++) {
+        size_t i;
+        {
+            unique_lock<mutex> hold(m);
+            arrived.wait(hold, [&] { return !ready.empty(); });
+            i = ready.front();
+            ready.pop_front();
+        }
+        decodes.push_back(pool.submit([&, i] {
+            if (!unpack(data[i].data(), data[i].size(), h.flags & Deflate, map, int(i/side)*REGION, int(i%side)*REGION))
+                good = false;
+            vector<uint8_t>().swap(data[i]);
+        }, TaskPool::High));
+    }
+    for (auto& d : decodes)
+        pool.wait(d);
+    ::close(fd);
+    return good;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "terrain.h"
+
+// whole maps saved compactly as square regions. Heights are quantized to STEP, each row is stored as its
+// difference to the row before it (the first as differences along itself), zigzag coded and bit-packed at
+// the width of its largest value, optionally followed by deflate over each region.
+// Values of a row are packed in LANES interleaved streams, value i in lane i%LANES, so unpacking a row
+// works on LANES consecutive words at a time and compiles to vector instructions without intrinsics.
+//
+// A 64 byte header is followed by regions+1 uint64 offsets of the regions, ordered by region x then z.
+// A region is REGION widths in bytes and then, per row, width*LANES uint32 words.
+class Regions {
+public:
+    static const uint32_t VERSION = 1;
+    static const int HEADER = 64;
+    static const int REGION = 256; // heights per region side
+    static const int LARGEST = (1 << 14)-1; // map side, that of the largest whole map comanche-gen makes
+    static const int LANES = 8;
+    static constexpr float STEP = 1/8.f; // in blocks, heights come back within STEP/2
+    enum Flags {Deflate = 1};
+
+    // the map's regions ordered by region x then z, packed in parallel; false if deflate failed
+    static bool compress(const Map& map, bool deflate, std::vector<std::vector<uint8_t>>& regions);
+    // the inverse into map.heights, for map.size; false on malformed data
+    static bool decompress(const std::vector<std::vector<uint8_t>>& regions, bool deflate, Map& map);
+
+    // the most compress can hold for a map of this size, every row at full width and deflate gaining nothing
+    static size_t bound(int size, bool deflate);
+
+    static bool save(const char* path, const Map& map, bool deflate, size_t& bytes);
+    // the map and its parameters, its position and scale left at 0
+    static bool load(const char* path, Map& map);
+
+private:
+    static void encode(const Map& map, int x, int z, std::vector<uint8_t>& out);
+    static bool decode(const uint8_t* data, size_t n, Map& map, int x, int z);
+    static bool unpack(const uint8_t* data, size_t n, bool deflate, Map& map, int x, int z);
+};
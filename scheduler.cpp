@@ -0,0 +1,194 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+#include "tasks.h"
+#include "timer.h"
+#include "trace.h"
+
+using namespace std;
+using namespace glm;
+
+constexpr float ChunkScheduler::ANGLE_CHUNKS;
+
+static bool later(const ChunkScheduler::Job& a, const ChunkScheduler::Job& b) {
+    return a.priority > b.priority;
+}
+
+float ChunkScheduler::priority(ChunkKey key, vec3 eye, vec3 direction) {
+    const float n = ChunkMesh::SIZE;
+    auto to = vec2((key.first+0.5f)*n-eye.x, (key.second+0.5f)*n-eye.z);
+    auto forward = vec2(direction.x, direction.z);
+    auto d = length(to)/n;
+    // the chunk underfoot and a camera looking straight down have no direction to prefer
+    if (d < 1 || length(forward) < 1e-3f)
+        return d;
+    auto angle = acos(clamp(dot(normalize(to), normalize(forward)), -1.f, 1.f));
+    return d + angle/3.14159265f*ANGLE_CHUNKS;
+}
+
+void ChunkScheduler::reset(const Map& world, bool instanced, TileFile* tiles) {
+    lock_guard<mutex> hold(lock);
+    this->world = world;
+    this->world.heights.clear();
+    this->instanced = instanced;
+    this->tiles = tiles;
+    queue.clear();
+    reads.clear();
+    done.clear();
+    generation++;
+}
+
+void ChunkScheduler::update(const vector<pair<float, ChunkKey>>& wanted, const function<void(Job&)>& make) {
+    size_t more;
+    vector<ChunkKey> fetch;
+    TileFile* source;
+    int gen;
+    {
+        lock_guard<mutex> hold(lock);
+        map<ChunkKey, Job*> old;
+        for (auto& j : queue)
+            old[j.key] = &j;
+        set<ChunkKey> finished;
+        for (auto& r : done)
+            finished.insert(r.key);
+
+        vector<Job> next;
+        next.reserve(wanted.size());
+        for (auto& w : wanted) {
+            if (running.count(w.second) || finished.count(w.second))
+                continue;
+            auto r = reads.find(w.second);
+            if (r != reads.end()) {
+                r->second = w.first;
+                continue;
+            }
+            auto j = old.find(w.second);
+            if (j != old.end()) {
+                next.push_back(move(*j->second));
+                old.erase(j);
+            } else {
+                next.push_back(Job {w.second});
+                make(next.back());
+                // heights neither cached nor made are read first
+                if (tiles && next.back().heights.empty()) {
+                    next.pop_back();
+                    reads[w.second] = w.first;
+                    fetch.push_back(w.second);
+                    continue;
+                }
+            }
+            next.back().priority = w.first;
+        }
+        // what is left of the old queue is no longer wanted
+        cancelled += old.size();
+        queue.swap(next);
+        make_heap(queue.begin(), queue.end(), later);
+        more = queue.size() > tokens ? queue.size()-tokens : 0;
+        tokens += more;
+        source = tiles;
+        gen = generation;
+    }
+    // tasks take whatever job is most urgent when they start, not the one they were submitted for
+    for (size_t i = 0; i < more; i++)
+        TaskPool::shared().submit([this] { work(); }, TaskPool::Normal);
+    // a one sample border for the walls
+    const auto n = ChunkMesh::SIZE;
+    for (auto& key : fetch)
+        source->fetch(key.first*n-1, key.second*n-1, n+2, n+2, [this, key, gen](bool ok, vector<float>& heights) {
+            arrived(key, gen, ok, heights);
+        });
+}
+
+void ChunkScheduler::arrived(ChunkKey key, int gen, bool ok, vector<float>& heights) {
+    {
+        lock_guard<mutex> hold(lock);
+        auto r = reads.find(key);
+        if (gen != generation || r == reads.end())
+            return;
+        // nothing is made or cached from a failed read, the chunk stays missing and is fetched again
+        if (!ok) {
+            reads.erase(r);
+            failed++;
+            return;
+        }
+        // one no longer wanted is cancelled by the next update
+        queue.push_back(Job {key, r->second, move(heights), true});
+        push_heap(queue.begin(), queue.end(), later);
+        reads.erase(r);
+        tokens++;
+    }
+    TaskPool::shared().submit([this] { work(); }, TaskPool::Normal);
+}
+
+bool ChunkScheduler::take(Result& r) {
+    lock_guard<mutex> hold(lock);
+    if (done.empty())
+        return false;
+    r = move(done.front());
+    done.pop_front();
+    return true;
+}
+
+size_t ChunkScheduler::queued() {
+    lock_guard<mutex> hold(lock);
+    return queue.size();
+}
+
+size_t ChunkScheduler::reading() {
+    lock_guard<mutex> hold(lock);
+    return reads.size();
+}
+
+size_t ChunkScheduler::in_flight() {
+    lock_guard<mutex> hold(lock);
+    return running.size();
+}
+
+void ChunkScheduler::work() {
+    unique_lock<mutex> hold(lock);
+    tokens--;
+    if (queue.empty())
+        return;
+    pop_heap(queue.begin(), queue.end(), later);
+    auto job = move(queue.back());
+    queue.pop_back();
+    running.insert(job.key);
+    auto gen = generation;
+    auto params = world;
+    auto columns = instanced;
+    // a tiled world ends at its edge, generated ones go on
+    auto edge = tiles ? params.size : 0;
+    hold.unlock();
+
+    Result r;
+    r.key = job.key;
+    r.generated = job.heights.empty() || job.read;
+    r.noise_ms = r.shape_ms = 0;
+    {
+        TRACE_ZONE("chunk job");
+        // a one sample border for the walls
+        const auto n = ChunkMesh::SIZE;
+        Map map {params.seed, n+2, params.frequency, params.exponent, job.key.first*n-1, job.key.second*n-1, float(params.size)};
+        auto t = now_ms();
+        if (job.heights.empty()) {
+            map.noise();
+            r.noise_ms = float(now_ms()-t);
+            t = now_ms();
+            map.shape();
+            r.shape_ms = float(now_ms()-t);
+            t = now_ms();
+        } else
+            map.heights = move(job.heights);
+        r.mesh.build(map, 1, 1, columns, edge);
+        r.mesh_ms = float(now_ms()-t);
+        r.heights = move(map.heights);
+    }
+
+    hold.lock();
+    running.erase(job.key);
+    if (gen == generation)
+        done.push_back(move(r));
+}
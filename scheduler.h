@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "chunk_cache.h"
+#include "terrain.h"
+#include "tiles.h"
+
+// generates and meshes streamed chunks as normal priority pool tasks, most urgent first.
+// The main thread resubmits what it is missing every frame and uploads what is done.
+// Chunks of a tiled world first read their heights on the I/O queue and are queued once they arrive.
+class ChunkScheduler {
+public:
+    // a chunk straight behind the camera waits like one this many chunks farther
+    static constexpr float ANGLE_CHUNKS = 8;
+
+    class Job {
+    public:
+        ChunkKey key;
+        float priority; // lower goes first
+        std::vector<float> heights; // cached or read padded heights, empty to generate them
+        bool read; // heights came from the tiles, not the cache
+    };
+
+    class Result {
+    public:
+        ChunkKey key;
+        bool generated; // heights are new and worth caching
+        std::vector<float> heights;
+        ChunkMesh mesh;
+        float noise_ms, shape_ms, mesh_ms;
+    };
+
+    // queued jobs dropped because they went out of range, and results dropped for the same reason
+    size_t cancelled = 0;
+    // tile reads that failed, their chunks are left missing so the next update reads them again
+    std::atomic<size_t> failed {0};
+
+    // chunks in front of the camera first, then by distance; eye in blocks
+    static float priority(ChunkKey key, glm::vec3 eye, glm::vec3 direction);
+
+    // drops every job and result, new jobs use these world parameters or read heights from tiles
+    void reset(const Map& world, bool instanced, TileFile* tiles = nullptr);
+
+    // replaces the queue by these keys and priorities, skipping those being read, in flight or done.
+    // Jobs already queued keep their heights, make fills in new ones under the lock.
+    void update(const std::vector<std::pair<float, ChunkKey>>& wanted, const std::function<void(Job&)>& make);
+    // the oldest finished chunk, false when there is none
+    bool take(Result& r);
+
+    size_t queued();
+    size_t reading();
+    size_t in_flight();
+
+private:
+    std::mutex lock;
+    std::vector<Job> queue; // a heap, lowest priority value on top
+    std::map<ChunkKey, float> reads; // keys whose heights are on the I/O queue, to their latest priority
+    std::set<ChunkKey> running;
+    std::deque<Result> done;
+    Map world {};
+    bool instanced = false;
+    TileFile* tiles = nullptr;
+    int generation = 0; // results of older generations are dropped
+    size_t tokens = 0; // pool tasks submitted that have not taken a job yet
+
+    // queues a job with the heights read for it, or forgets the read if it failed
+    void arrived(ChunkKey key, int generation, bool ok, std::vector<float>& heights);
+    // runs the most urgent job, if any is left
+    void work();
+};
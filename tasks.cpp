@@ -0,0 +1,251 @@
+#include "tasks.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "timer.h"
+#include "trace.h"
+
+using namespace std;
+
+// the pool and slot of the calling thread, -1 outside any pool
+static thread_local TaskPool* current_pool = nullptr;
+static thread_local int current_slot = -1;
+// tasks run inside other tasks by waiting threads, not counted twice as busy
+static thread_local int depth = 0;
+
+TaskPool& TaskPool::shared() {
+    static TaskPool pool;
+    static once_flag started;
+    call_once(started, [] { pool.resize(max(1, int(thread::hardware_concurrency())-1)); });
+    return pool;
+}
+
+TaskPool::~TaskPool() {
+    resize(0);
+}
+
+void TaskPool::resize(int n) {
+    {
+        lock_guard<mutex> hold(sleep_lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    slots.clear();
+    queued = 0;
+    quit = false;
+
+    for (int i = 0; i <= n; i++)
+        slots.emplace_back(new Slot);
+    for (int i = 0; i < n; i++)
+        threads.emplace_back(&TaskPool::work, this, i);
+}
+
+TaskPool::Handle TaskPool::submit(function<void()> f, Priority p, const vector<Handle>& after) {
+    auto t = make_shared<Task>();
+    t->run = move(f);
+    t->priority = p;
+    t->waiting = 1;
+    t->done = false;
+    for (auto& d : after) {
+        lock_guard<mutex> hold(d->lock);
+        if (d->done)
+            continue;
+        t->waiting++;
+        d->dependents.push_back(t);
+    }
+    if (--t->waiting == 0)
+        push(t);
+    return t;
+}
+
+void TaskPool::wait(const Handle& h) {
+    auto joined = self() < 0 && join();
+    help_until([&] { return bool(h->done); });
+    if (joined)
+        leave();
+}
+
+void TaskPool::parallel_for(size_t begin, size_t end, const function<void(size_t, size_t)>& f, size_t grain, Priority p) {
+    if (begin >= end)
+        return;
+    if (!grain)
+        grain = max<size_t>(1, (end-begin)/256);
+    if (!size() || end-begin <= grain) {
+        for (auto lo = begin; lo < end; lo += grain)
+            f(lo, min(end, lo+grain));
+        return;
+    }
+
+    atomic<size_t> pending(1);
+    auto joined = self() < 0 && join();
+    if (self() >= 0)
+        split(begin, end, f, grain, p, pending);
+    else
+        // another outside thread holds the extra slot, so the range is left to the workers
+        submit([&] { split(begin, end, f, grain, p, pending); }, p);
+    help_until([&] { return pending == 0; });
+    if (joined)
+        leave();
+}
+
+void TaskPool::split(size_t lo, size_t hi, const function<void(size_t, size_t)>& f, size_t grain,
+    Priority p, atomic<size_t>& pending) {
+    auto& own = *slots[self()];
+    while (lo < hi) {
+        bool empty;
+        {
+            lock_guard<mutex> hold(own.lock);
+            empty = own.tasks[p].empty();
+        }
+        if (hi-lo > grain && empty) {
+            // on a tile boundary, lo always is one
+            auto mid = lo+((hi-lo)/grain+1)/2*grain;
+            pending++;
+            submit([=, &f, &pending] { split(mid, hi, f, grain, p, pending); }, p);
+            hi = mid;
+            continue;
+        }
+        auto e = min(hi, lo+grain);
+        f(lo, e);
+        lo = e;
+    }
+    if (--pending == 0)
+        notify_finished();
+}
+
+void TaskPool::busy(vector<uint64_t>& ns) const {
+    ns.resize(max(size(), 0));
+    for (size_t i = 0; i < ns.size(); i++)
+        ns[i] = slots[i]->busy_ns;
+}
+
+int TaskPool::self() const {
+    return current_pool == this ? current_slot : -1;
+}
+
+// an outside thread takes the extra slot while it waits, if no other one has it
+bool TaskPool::join() {
+    if (!external.try_lock())
+        return false;
+    current_pool = this;
+    current_slot = size();
+    return true;
+}
+
+void TaskPool::leave() {
+    current_pool = nullptr;
+    current_slot = -1;
+    external.unlock();
+}
+
+// workers push onto their own deque, other threads spread tasks round robin
+void TaskPool::push(const Handle& t) {
+    auto s = self();
+    if (s < 0)
+        s = size() ? next++ % size() : size();
+    auto& slot = *slots[s];
+    {
+        lock_guard<mutex> hold(slot.lock);
+        slot.tasks[t->priority].push_back(t);
+    }
+    queued++;
+    { lock_guard<mutex> hold(sleep_lock); }
+    wake.notify_one();
+}
+
+TaskPool::Handle TaskPool::pop(int self) {
+    auto n = slots.size();
+    for (int p = 0; p < PRIORITIES; p++)
+        for (size_t i = 0; i < n; i++) {
+            auto& slot = *slots[(self+i)%n];
+            lock_guard<mutex> hold(slot.lock);
+            auto& d = slot.tasks[p];
+            if (d.empty())
+                continue;
+            Handle t;
+            if (i == 0) {
+                t = move(d.back());
+                d.pop_back();
+            } else {
+                t = move(d.front());
+                d.pop_front();
+            }
+            queued--;
+            return t;
+        }
+    return nullptr;
+}
+
+bool TaskPool::help(int self) {
+    if (self < 0)
+        return false;
+    auto t = pop(self);
+    if (!t)
+        return false;
+    run(t, self);
+    return true;
+}
+
+// runs tasks while there are any, otherwise sleeps until something finishes or a millisecond passes
+void TaskPool::help_until(const function<bool()>& done) {
+    auto s = self();
+    while (!done()) {
+        if (help(s))
+            continue;
+        waiters++;
+        {
+            unique_lock<mutex> hold(sleep_lock);
+            finished.wait_for(hold, chrono::milliseconds(1), done);
+        }
+        waiters--;
+    }
+}
+
+void TaskPool::run(const Handle& t, int self) {
+    auto start = depth ? 0 : now_ns();
+    depth++;
+    {
+        TRACE_ZONE("task");
+        t->run();
+    }
+    depth--;
+    if (!depth)
+        slots[self]->busy_ns += now_ns()-start;
+
+    vector<Handle> ready;
+    {
+        lock_guard<mutex> hold(t->lock);
+        t->done = true;
+        for (auto& d : t->dependents)
+            if (--d->waiting == 0)
+                ready.push_back(d);
+        t->dependents.clear();
+    }
+    for (auto& d : ready)
+        push(d);
+    notify_finished();
+}
+
+void TaskPool::notify_finished() {
+    if (!waiters)
+        return;
+    { lock_guard<mutex> hold(sleep_lock); }
+    finished.notify_all();
+}
+
+void TaskPool::work(int self) {
+    current_pool = this;
+    current_slot = self;
+    for (;;) {
+        if (help(self))
+            continue;
+        unique_lock<mutex> hold(sleep_lock);
+        wake.wait(hold, [&] { return quit || queued > 0; });
+        if (quit)
+            return;
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// one work-stealing pool for all terrain work. Every worker takes the newest task of its own deque
+// and steals the oldest of others, high priority first. A thread outside the pool that waits joins in
+// through one extra deque, so n workers and the caller run at most n+1 tasks at once.
+class TaskPool {
+public:
+    enum Priority {High, Normal, PRIORITIES};
+
+    class Task {
+    public:
+        std::function<void()> run;
+        Priority priority;
+        std::atomic<int> waiting; // unfinished dependencies, plus one until submitted
+        std::atomic<bool> done;
+        std::mutex lock;
+        std::vector<std::shared_ptr<Task>> dependents;
+    };
+    typedef std::shared_ptr<Task> Handle;
+
+    // a worker per core besides the caller, started on first use
+    static TaskPool& shared();
+
+    ~TaskPool();
+    // waits for running tasks and restarts with n workers, queued tasks are dropped.
+    // With none everything runs on whichever thread waits.
+    void resize(int workers);
+    int size() const {
+        return int(slots.size())-1;
+    }
+
+    // runs f once every task in after is done
+    Handle submit(std::function<void()> f, Priority p = Normal, const std::vector<Handle>& after = {});
+    void wait(const Handle& h);
+    // f(lo, hi) over [begin, end), halved only while the splitting thread's deque is empty, so idle workers
+    // get work and busy ones keep large pieces. f is always called on the same tiles [begin+k*grain, ...)
+    // whatever the number of workers; grain 0 picks one from the range alone
+    void parallel_for(size_t begin, size_t end, const std::function<void(size_t, size_t)>& f,
+        size_t grain = 0, Priority p = High);
+
+    // nanoseconds each worker spent running tasks since it started
+    void busy(std::vector<uint64_t>& ns) const;
+
+private:
+    class Slot {
+    public:
+        std::mutex lock;
+        std::deque<Handle> tasks[PRIORITIES];
+        std::atomic<uint64_t> busy_ns {0};
+    };
+
+    // a slot per worker and a last one for the outside thread that holds external
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<std::thread> threads;
+    std::mutex sleep_lock, external;
+    std::condition_variable wake, finished;
+    std::atomic<int> queued {0}, waiters {0};
+    std::atomic<unsigned> next {0};
+    bool quit = false;
+
+    int self() const;
+    bool join();
+    void leave();
+    void push(const Handle& t);
+    Handle pop(int self);
+    bool help(int self);
+    void help_until(const std::function<bool()>& done);
+    void run(const Handle& t, int self);
+    void work(int self);
+    void notify_finished();
+    void split(size_t lo, size_t hi, const std::function<void(size_t, size_t)>& f, size_t grain,
+        Priority p, std::atomic<size_t>& pending);
+};
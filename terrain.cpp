@@ -0,0 +1,155 @@
+#include "terrain.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+
+#include <OpenSimplex/OpenSimplex.h>
+
+#include "tasks.h"
+
+using namespace std;
+using namespace glm;
+
+constexpr float Block::THRESHOLDS[];
+constexpr float Column::CUBE[];
+constexpr uint8_t Column::CUBE_INDICES[];
+
+// samples per task at least, a chunk's map is not worth splitting
+static const int GRAIN = 1 << 14;
+
+// noise in [-1, 1] to a height in blocks
+static float height(float n, float scale, float exponent) {
+    return scale*pow(n, n < 0 ? floor(exponent) : exponent);
+}
+
+void Map::noise() {
+    OpenSimplex::Context ctx;
+    OpenSimplex::Seed::computeContextForSeed(ctx, seed);
+
+    auto s = world_scale();
+    heights.resize(size_t(size)*size);
+    TaskPool::shared().parallel_for(0, size, [&](size_t lo, size_t hi) {
+        for (int x = int(lo); x < int(hi); x++) {
+            auto nx = frequency*(float(this->x+x)/s);
+            for (int z = 0; z < size; z++) {
+                auto nz = frequency*(float(this->z+z)/s);
+                heights[size_t(x)*size+z] = OpenSimplex::Noise::noise2(ctx, nx, nz);
+            }
+        }
+    }, max(1, GRAIN/size));
+}
+
+void Map::shape() {
+    auto s = world_scale();
+    TaskPool::shared().parallel_for(0, heights.size(), [&](size_t lo, size_t hi) {
+        for (auto i = lo; i < hi; i++)
+            heights[i] = height(heights[i], s, exponent);
+    }, GRAIN);
+}
+
+void Map::sample(int x, int z, int step, int w, int h, float* out) const {
+    OpenSimplex::Context ctx;
+    OpenSimplex::Seed::computeContextForSeed(ctx, seed);
+
+    auto s = world_scale();
+    for (int i = 0; i < w; i++) {
+        auto nx = frequency*(float(x+i*step)/s);
+        for (int j = 0; j < h; j++)
+            out[size_t(i)*h+j] = height(OpenSimplex::Noise::noise2(ctx, nx, frequency*(float(z+j*step)/s)), s, exponent);
+    }
+}
+
+void Map::classify(vector<uint8_t>& types, const float* thresholds) const {
+    auto s = world_scale();
+    types.resize(heights.size());
+    TaskPool::shared().parallel_for(0, heights.size(), [&](size_t lo, size_t hi) {
+        for (auto i = lo; i < hi; i++)
+            types[i] = Block::type(heights[i]/s, thresholds);
+    }, GRAIN);
+}
+
+void ChunkMesh::build(const Map& map, int cx, int cz, bool instanced, int world_size) {
+    ox = cx;
+    oz = cz;
+    ex = world_size ? max(0, min(map.size, world_size-map.x)) : map.size;
+    ez = world_size ? max(0, min(map.size, world_size-map.z)) : map.size;
+    x = map.x+cx;
+    z = map.z+cz;
+    lo = vec3(x-0.5f, FLT_MAX, z-0.5f);
+    hi = vec3(map.x+min(cx+SIZE, ex)-0.5f, -FLT_MAX, map.z+min(cz+SIZE, ez)-0.5f);
+    top = FLT_MAX;
+    vertices.clear();
+    indices.clear();
+    columns.clear();
+
+    for (int x = cx; x < ex && x < cx+SIZE; x++)
+        for (int z = cz; z < ez && z < cz+SIZE; z++) {
+            top = min(top, map.at(x, z)+0.5f);
+            instanced ? add_column(map, x, z) : add_block(map, x, z);
+        }
+    // walls reach up and down to neighbours outside the chunk
+    for (int x = max(cx-1, 0); x < ex && x <= cx+SIZE; x++)
+        for (int z = max(cz-1, 0); z < ez && z <= cz+SIZE; z++) {
+            lo.y = min(lo.y, map.at(x, z)-1);
+            hi.y = max(hi.y, map.at(x, z)+0.5f);
+        }
+}
+
+size_t ChunkMesh::bytes() const {
+    return vertices.size()*sizeof(float) + indices.size()*sizeof(int) + columns.size()*sizeof(Column);
+}
+
+void ChunkMesh::add_face(initializer_list<int> face, bool cond) {
+    if (cond)
+        for (int i : face)
+            indices.push_back(i+(vertices.size()-36)/3);
+}
+
+void ChunkMesh::add_block(const Map& map, int x, int z) {
+    const auto a = 0.5f;
+    auto y = map.at(x, z),
+         y0 = z == ez-1 ? -1 : a-y+map.at(x, z+1),
+         y1 = z == 0 ? -1 : a-y+map.at(x, z-1),
+         y2 = x == ex-1 ? -1 : a-y+map.at(x+1, z),
+         y3 = x == 0 ? -1 : a-y+map.at(x-1, z);
+    array<float, 36> verts {
+        -a, y0,  a,
+         a, y0,  a,
+         a,  a,  a,
+        -a,  a,  a,
+        -a, y1, -a,
+        -a,  a, -a,
+         a,  a, -a,
+         a, y1, -a,
+        -a, y3,  a,
+         a, y2,  a,
+        -a, y3, -a,
+         a, y2, -a
+    };
+    for (size_t i = 0; i < verts.size();) {
+        vertices.insert(vertices.end(), {verts[i++]+(x-ox), verts[i++]+y, verts[i++]+(z-oz)});
+    }
+
+    // each triangle ends on a top vertex, the provoking vertex for the material
+    add_face({0,  1, 2,  0, 2, 3}, y0 > a && z < ez-1); // +z
+    add_face({4,  5, 6,  7, 4, 6}, y1 > a && z > 0); // -z
+    add_face({3,  2, 6,  6, 5, 3}, true); // +y
+    add_face({9, 11, 6,  9, 6, 2}, y2 > a && x < ex-1); // +x
+    add_face({8,  3, 5, 10, 8, 5}, y3 > a && x > 0); // -x
+}
+
+void ChunkMesh::add_column(const Map& map, int x, int z) {
+    auto y = map.at(x, z),
+         low = y;
+    if (z < ez-1) low = min(low, map.at(x, z+1));
+    if (z > 0) low = min(low, map.at(x, z-1));
+    if (x < ex-1) low = min(low, map.at(x+1, z));
+    if (x > 0) low = min(low, map.at(x-1, z));
+    columns.push_back({
+        uint32_t(x-ox) | uint32_t(z-oz) << 14,
+        int16_t(round(y*8)),
+        int16_t(round(low*8))
+    });
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// terrain generation and meshing, no GL or window required
+
+class Block {
+public:
+    enum Type {WaterDeep=1, WaterShallow, Grass, Forest, Stone, Snow};
+    // lower bound of each type above WaterDeep, as a fraction of the map size
+    static constexpr float THRESHOLDS[] = {-0.5, 0.0, 0.3, 0.5, 0.7};
+
+    static Type type(float y, const float* thresholds = THRESHOLDS) {
+        auto t = int(WaterDeep);
+        for (int i = 0; i < 5; i++)
+            t += y >= thresholds[i];
+        return Type(t);
+    }
+};
+
+// one instance of a unit column: x and z within the chunk packed 14/14 bits, heights in 1/8 blocks
+class Column {
+public:
+    uint32_t xz;
+    int16_t y, low;
+
+    static constexpr float CUBE[] = {
+        -0.5, 0,  0.5,
+         0.5, 0,  0.5,
+         0.5, 0, -0.5,
+        -0.5, 0, -0.5,
+        -0.5, 1,  0.5,
+         0.5, 1,  0.5,
+         0.5, 1, -0.5,
+        -0.5, 1, -0.5
+    };
+    static constexpr uint8_t CUBE_INDICES[] = {
+        0, 1, 5, 5, 4, 0, // +z
+        3, 7, 6, 6, 2, 3, // -z
+        4, 5, 6, 6, 7, 4, // +y
+        1, 2, 6, 6, 5, 1, // +x
+        0, 4, 7, 7, 3, 0  // -x
+    };
+};
+
+static_assert(sizeof(Column) == 8, "column instances are 8 bytes");
+
+// size*size heights starting at world block (x, z), sampled in world coordinates so
+// neighbouring maps line up; a whole world is the map at (0, 0) with scale 0
+class Map {
+public:
+    int seed, size;
+    float frequency, exponent;
+    int x, z;
+    float scale; // blocks per noise unit and height of a noise peak, size when 0
+    std::vector<float> heights;
+
+    // raw simplex noise in [-1, 1]
+    void noise();
+    // turns noise into heights in blocks
+    void shape();
+    // noise and shape of w*h blocks (x+i*step, z+j*step) at index i*h+j, in world blocks whatever the map's
+    // position and without touching heights
+    void sample(int x, int z, int step, int w, int h, float* out) const;
+    void classify(std::vector<uint8_t>& types, const float* thresholds = Block::THRESHOLDS) const;
+
+    float at(int x, int z) const {
+        return heights[size_t(x)*size+z];
+    }
+
+    float world_scale() const {
+        return scale > 0 ? scale : size;
+    }
+};
+
+// geometry of one SIZE*SIZE block chunk, either a block mesh or column instances.
+// Vertices and columns are relative to the chunk's world position (x, z), bounds are in world blocks.
+class ChunkMesh {
+public:
+    static const int SIZE = 64;
+
+    int x, z;
+    glm::vec3 lo, hi;
+    float top; // lowest column top, everything below is solid
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    std::vector<Column> columns;
+
+    // the chunk starting at map sample (x, z); samples on the map border only feed the walls.
+    // A map cut from a finite world of world_size blocks ends at that world's edge as well, 0 for none
+    void build(const Map& map, int x, int z, bool instanced, int world_size = 0);
+    size_t bytes() const;
+
+private:
+    int ox, oz; // map sample of the chunk origin
+    int ex, ez; // map samples past the last one, the map's or the world's edge
+
+    void add_face(std::initializer_list<int> face, bool cond);
+    void add_block(const Map& map, int x, int z);
+    void add_column(const Map& map, int x, int z);
+};
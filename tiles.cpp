@@ -0,0 +1,316 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_queue.h"
+
+using namespace std;
+
+class Header {
+public:
+    char magic[4];
+    uint32_t version, size, tile;
+    int32_t seed;
+    float frequency, exponent;
+};
+
+static_assert(sizeof(Header) <= TileFile::PAGE, "the header fits its page");
+
+// the whole of n bytes at offset, retrying short writes
+static bool write_at(int fd, const void* data, size_t n, uint64_t offset) {
+    auto p = (const char*)data;
+    while (n) {
+        auto done = pwrite(fd, p, n, off_t(offset));
+        if (done <= 0)
+            return false;
+        p += done;
+        n -= done;
+        offset += done;
+    }
+    return true;
+}
+
+TileFile::~TileFile() {
+    close();
+}
+
+bool TileFile::create(const char* path, const Map& params, int tile) {
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    seed = params.seed;
+    size = params.size;
+    frequency = params.frequency;
+    exponent = params.exponent;
+    this->tile = tile;
+
+    char header[PAGE] = {};
+    Header h {{'C', 'T', 'I', 'L'}, VERSION, uint32_t(size), uint32_t(tile), seed, frequency, exponent};
+    memcpy(header, &h, sizeof(h));
+    // sparse until tiles are written
+    return write_at(fd, header, PAGE, 0) && ftruncate(fd, off_t(bytes())) == 0;
+}
+
+bool TileFile::write(int tx, int tz, const vector<float>& heights, int level) {
+    if (heights.size() != size_t(tile)*tile)
+        return false;
+    return write_at(fd, heights.data(), heights.size()*sizeof(float), PAGE + index(level, tx, tz)*stride());
+}
+
+bool TileFile::open(const char* path) {
+    close();
+    fd = ::open(path, O_RDONLY);
+    Header h;
+    struct stat s;
+    // the sizes are checked before anything is derived from them
+    if (fd < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "CTIL", 4) || h.version != VERSION ||
+        h.size < 2 || h.size > uint32_t(LARGEST) || !h.tile || h.tile > uint32_t(LARGEST) || (h.tile & (h.tile-1)) ||
+        fstat(fd, &s)) {
+        close();
+        return false;
+    }
+    seed = h.seed;
+    size = int(h.size);
+    tile = int(h.tile);
+    frequency = h.frequency;
+    exponent = h.exponent;
+    // a short file would fault on its missing tiles
+    if (uint64_t(s.st_size) < bytes()) {
+        close();
+        return false;
+    }
+    auto p = mmap(nullptr, size_t(bytes()), PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close();
+        return false;
+    }
+    mapped = (const char*)p;
+    // tiles are laid out by x, so sequential readahead would mostly fetch tiles far from the camera
+    madvise(p, size_t(bytes()), MADV_RANDOM);
+    return true;
+}
+
+bool TileFile::close() {
+    unique_lock<mutex> hold(lock);
+    idle.wait(hold, [&] { return !requests; });
+    if (mapped)
+        munmap((void*)mapped, size_t(bytes()));
+    mapped = nullptr;
+    touched.clear();
+    cache.bytes = 0;
+    auto ok = fd < 0 || ::close(fd) == 0;
+    fd = -1;
+    size = 0;
+    return ok;
+}
+
+uint64_t TileFile::index(int level, int tx, int tz) const {
+    uint64_t n = 0;
+    for (int l = 0; l < level; l++)
+        n += uint64_t(tiles(l))*tiles(l);
+    return n + uint64_t(tx)*tiles(level)+tz;
+}
+
+CacheStats TileFile::stats() {
+    lock_guard<mutex> hold(lock);
+    return cache;
+}
+
+void TileFile::budget(size_t bytes) {
+    lock_guard<mutex> hold(lock);
+    cache.budget = bytes;
+}
+
+// the pages of one tile out of the mapping, rounded out to the system page size, and out of the page cache,
+// where fetched tiles were read into
+void TileFile::drop(uint64_t i) {
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    auto offset = PAGE + i*stride();
+    auto begin = offset/page*page,
+         end = offset+stride();
+    madvise((void*)(mapped+begin), size_t(end-begin), MADV_DONTNEED);
+    posix_fadvise(fd, off_t(offset), off_t(stride()), POSIX_FADV_DONTNEED);
+}
+
+// marks a tile used, read in place or fetched, dropping the pages of the least recently used ones over
+// budget. Dropped pages are clean, so they are simply read again if touched.
+void TileFile::touch(uint64_t i) {
+    lock_guard<mutex> hold(lock);
+    auto t = touched.find(i);
+    if (t != touched.end()) {
+        cache.hits++;
+        t->second = ++clock;
+        return;
+    }
+    cache.misses++;
+    touched[i] = ++clock;
+    cache.bytes += stride();
+    while (cache.bytes > cache.budget && touched.size() > 1) {
+        auto oldest = touched.end();
+        for (auto r = touched.begin(); r != touched.end(); ++r)
+            if (r->first != i && (oldest == touched.end() || r->second < oldest->second))
+                oldest = r;
+        drop(oldest->first);
+        cache.bytes -= stride();
+        cache.evictions++;
+        touched.erase(oldest);
+    }
+}
+
+const float* TileFile::data(int tx, int tz, int level) {
+    auto i = index(level, tx, tz);
+    touch(i);
+    return (const float*)(mapped + PAGE + i*stride());
+}
+
+float TileFile::at(int x, int z) {
+    x = min(max(x, 0), size-1);
+    z = min(max(z, 0), size-1);
+    return data(x/tile, z/tile)[size_t(x%tile)*tile + z%tile];
+}
+
+bool TileFile::read(int x, int z, int w, int h, vector<float>& out) {
+    if (!mapped)
+        return false;
+    out.resize(size_t(w)*h);
+    const float* t = nullptr;
+    int tx = -1, tz = -1;
+    for (int i = 0; i < w; i++) {
+        auto gx = min(max(x+i, 0), size-1);
+        for (int j = 0; j < h; j++) {
+            auto gz = min(max(z+j, 0), size-1);
+            if (gx/tile != tx || gz/tile != tz) {
+                tx = gx/tile;
+                tz = gz/tile;
+                t = data(tx, tz);
+            }
+            out[size_t(i)*h+j] = t[size_t(gx%tile)*tile + gz%tile];
+        }
+    }
+    return true;
+}
+
+void TileFile::sample(int x, int z, int step, int w, int h, float* out) {
+    if (!mapped) {
+        fill(out, out+size_t(w)*h, 0.f);
+        return;
+    }
+    auto level = 0;
+    while (2 << level <= step && level+1 < levels())
+        level++;
+    // texels of the level from one sample to the next, and its edge
+    auto d = step >> level,
+         last = side(level)-1;
+    const float* t = nullptr;
+    int tx = -1, tz = -1;
+    for (int i = 0; i < w; i++) {
+        auto gx = min(max((x >> level)+i*d, 0), last);
+        for (int j = 0; j < h; j++) {
+            auto gz = min(max((z >> level)+j*d, 0), last);
+            if (gx/tile != tx || gz/tile != tz) {
+                tx = gx/tile;
+                tz = gz/tile;
+                t = data(tx, tz, level);
+            }
+            out[size_t(i)*h+j] = t[size_t(gx%tile)*tile + gz%tile];
+        }
+    }
+}
+
+void TileFile::fetch(int x, int z, int w, int h, const function<void(bool, vector<float>&)>& done) {
+    if (fd < 0) {
+        vector<float> none;
+        done(false, none);
+        return;
+    }
+    // the rows of each tile the window covers, the map edge repeated beyond it
+    class Piece {
+    public:
+        int row;
+        vector<float> heights;
+    };
+    class Fetch {
+    public:
+        vector<Piece> pieces;
+        atomic<int> left;
+        atomic<bool> ok;
+    };
+    auto clamp = [&](int v) { return min(max(v, 0), size-1); };
+    auto x0 = clamp(x), x1 = clamp(x+w-1),
+         z0 = clamp(z), z1 = clamp(z+h-1);
+    auto f = make_shared<Fetch>();
+    vector<IoQueue::Request> batch;
+    for (auto tx = x0/tile; tx <= x1/tile; tx++)
+        for (auto tz = z0/tile; tz <= z1/tile; tz++) {
+            auto lo = max(x0, tx*tile)-tx*tile,
+                 hi = min(x1, tx*tile+tile-1)-tx*tile;
+            touch(index(0, tx, tz));
+            f->pieces.push_back(Piece {lo, vector<float>(size_t(hi-lo+1)*tile)});
+            batch.push_back({IoQueue::Request::Read, fd, nullptr, f->pieces.back().heights.size()*sizeof(float),
+                PAGE + index(0, tx, tz)*stride() + uint64_t(lo)*tile*sizeof(float), nullptr});
+        }
+    f->left = int(batch.size());
+    f->ok = true;
+    auto columns = z1/tile-z0/tile+1;
+    for (size_t k = 0; k < batch.size(); k++) {
+        batch[k].data = f->pieces[k].heights.data();
+        batch[k].done = [=](bool ok) {
+            if (!ok)
+                f->ok = false;
+            if (--f->left == 0) {
+                vector<float> out(size_t(w)*h);
+                for (int i = 0; i < w; i++) {
+                    auto gx = clamp(x+i);
+                    for (int j = 0; j < h; j++) {
+                        auto gz = clamp(z+j);
+                        auto& p = f->pieces[(gx/tile-x0/tile)*columns + gz/tile-z0/tile];
+                        out[size_t(i)*h+j] = p.heights[size_t(gx%tile-p.row)*tile + gz%tile];
+                    }
+                }
+                done(f->ok, out);
+            }
+            retire();
+        };
+    }
+    {
+        lock_guard<mutex> hold(lock);
+        requests += batch.size();
+    }
+    IoQueue::shared().submit(batch);
+}
+
+void TileFile::prefetch(int x, int z, int radius) {
+    if (fd < 0)
+        return;
+    auto last = tiles()-1;
+    auto x0 = max(0, x-radius)/tile, x1 = min(last, max(0, x+radius)/tile),
+         z0 = max(0, z-radius)/tile, z1 = min(last, max(0, z+radius)/tile);
+    vector<IoQueue::Request> batch;
+    {
+        lock_guard<mutex> hold(lock);
+        for (auto tx = x0; tx <= x1; tx++)
+            for (auto tz = z0; tz <= z1; tz++)
+                // resident tiles need no hint
+                if (!touched.count(index(0, tx, tz)))
+                    batch.push_back({IoQueue::Request::Advise, fd, nullptr, size_t(stride()),
+                        PAGE + index(0, tx, tz)*stride(), [this](bool) { retire(); }});
+        requests += batch.size();
+    }
+    IoQueue::shared().submit(batch);
+}
+
+// one request of this file is off the I/O queue
+void TileFile::retire() {
+    lock_guard<mutex> hold(lock);
+    if (--requests == 0)
+        idle.notify_all();
+}
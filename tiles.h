@@ -0,0 +1,94 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "chunk_cache.h"
+#include "terrain.h"
+
+// a world's heights on disk as square tiles, so maps far larger than memory can be generated once and
+// flown over. Opened files are mapped read only: tiles page in when first touched and are read in place with
+// nothing to parse. Streamed chunks instead fetch their heights through the shared I/O queue, so no thread
+// blocks on a page fault. Either way only a budget of recently touched tiles is kept in memory.
+// A page of header is followed by tiles ordered by tile x then z, each tile*tile float32 at index x*tile+z
+// padded to a whole number of pages, so every tile starts on a page boundary. Coarser levels follow in the
+// same layout down to a single texel, texel (i, j) of level k the height of block (i << k, j << k), so sparse
+// samples such as the clipmap's read a few dense tiles rather than a page of every tile they cross.
+class TileFile {
+public:
+    static const uint32_t VERSION = 3;
+    static const int PAGE = 4096; // the header size and tile alignment, whatever the page size of the writer
+    static const int TILE = 256; // default tile side
+    static const int LARGEST = (1 << 20)-1; // largest side of a world, with a power of two tile no larger
+
+    int seed = 0, size = 0, tile = 0;
+    float frequency = 0, exponent = 0;
+
+    ~TileFile();
+
+    // an empty world of these parameters, tiles of every level are then written in any order, from any thread
+    bool create(const char* path, const Map& params, int tile);
+    bool write(int tx, int tz, const std::vector<float>& heights, int level = 0);
+    bool open(const char* path);
+    bool close();
+
+    // texels per side of a level, the last one holds a single texel
+    int side(int level) const {
+        return ((size-1) >> level) + 1;
+    }
+    int levels() const {
+        auto n = 1;
+        while (side(n-1) > 1)
+            n++;
+        return n;
+    }
+    int tiles(int level = 0) const {
+        return (side(level)+tile-1)/tile;
+    }
+    // bytes from one tile to the next
+    uint64_t stride() const {
+        return (uint64_t(tile)*tile*sizeof(float)+PAGE-1)/PAGE*PAGE;
+    }
+    // tiles before this one in the file, over all levels
+    uint64_t index(int level, int tx, int tz) const;
+    uint64_t bytes() const {
+        return PAGE + index(levels(), 0, 0)*stride();
+    }
+
+    // tiles read in place or fetched against their budget, workers update them while the renderer reads
+    CacheStats stats();
+    void budget(size_t bytes);
+
+    // the heights of a tile of a level in place, valid until close
+    const float* data(int tx, int tz, int level = 0);
+    // the height at world block (x, z), the map edge repeated beyond it
+    float at(int x, int z);
+    // w*h heights from world block (x, z) at index i*h+j, the map edge repeated beyond it; false if not open
+    bool read(int x, int z, int w, int h, std::vector<float>& out);
+    // w*h heights of blocks (x+i*step, z+j*step) at index i*h+j, the map edge repeated beyond it, for step a
+    // power of two and x, z multiples of it. Read in place from the level of that spacing, or the coarsest one
+    // beyond it, so a window only touches the few tiles it covers there, counted against the budget
+    void sample(int x, int z, int step, int w, int h, float* out);
+    // what read would put in heights, read on the shared I/O queue; done runs on an I/O thread, false on error
+    void fetch(int x, int z, int w, int h, const std::function<void(bool ok, std::vector<float>& heights)>& done);
+    // starts reading the tiles within radius blocks of (x, z) into the page cache in the background
+    void prefetch(int x, int z, int radius);
+
+private:
+    int fd = -1;
+    const char* mapped = nullptr;
+    std::mutex lock;
+    std::condition_variable idle;
+    size_t requests = 0; // on the I/O queue, close waits for them
+    CacheStats cache;
+    std::map<uint64_t, uint64_t> touched; // tile index to when it was last used
+    uint64_t clock = 0;
+
+    void touch(uint64_t i);
+    void retire();
+    void drop(uint64_t i);
+};
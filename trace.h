@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "timer.h"
+
+// timeline zones in the Chrome trace event format, for chrome://tracing or Perfetto.
+// TRACE_ZONE compiles to nothing unless COMANCHE_TRACE is defined.
+class Trace {
+public:
+    // events kept per thread, older ones are overwritten
+    static const int CAPACITY = 1 << 15;
+
+    // the TSC where there is one, a clock read costs twice as much; scaled to ns when written
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return now_ns();
+#endif
+    }
+
+    // records a finished zone on the calling thread's ring, name must outlive the trace
+    static void zone(const char* name, uint64_t begin, uint64_t end);
+
+    // writes every thread's events as trace.json format, safe while other threads record
+    static bool write(const char* path);
+};
+
+class TraceZone {
+public:
+    explicit TraceZone(const char* name) : name(name), begin(Trace::ticks()) {}
+
+    ~TraceZone() {
+        Trace::zone(name, begin, Trace::ticks());
+    }
+
+private:
+    const char* name;
+    uint64_t begin;
+};
+
+#ifdef COMANCHE_TRACE
+#define TRACE_CONCAT(a, b) a##b
+#define TRACE_ZONE_LINE(name, line) TraceZone TRACE_CONCAT(trace_zone_, line)(name)
+#define TRACE_ZONE(name) TRACE_ZONE_LINE(name, __LINE__)
+#else
+#define TRACE_ZONE(name)
+#endif